@@ -21,6 +21,7 @@ if [[ "$OSTYPE" == "darwin"* ]]; then
     export LSAN_OPTIONS="suppressions=./.github/asan_assets/lsan.supp"
     
     lua test.lua
+    lua test_logfilter.lua
 else
     make LUAINC="-I/usr/local/include/" CFLAGS="-fsanitize=address -g -Wall"
     export ASAN_OPTIONS=fast_unwind_on_malloc=false
@@ -29,4 +30,5 @@ else
     export LD_PRELOAD="$ASAN_LIB_ABS_PATH:./.github/asan_assets/libdlclose.so"
 
     lua test.lua
+    lua test_logfilter.lua
 fi
@@ -19,15 +19,91 @@ local CURRENT_SERVICE <const> = ltask.self()
 local CURRENT_SERVICE_LABEL <const> = ltask.label()
 
 ltask.log = {}
-for _, level in ipairs {"info","error"} do
-	ltask.log[level] = function (...)
-		local t = table.pack(...)
-		local str = {}
-		for i = 1, t.n do
-			str[#str+1] = tostring(t[i])
+
+do	-- log
+	local LOG_LEVEL <const> = { debug = 1, info = 2, warn = 3, error = 4 }
+	local log_level = LOG_LEVEL.info
+
+	local function log_value(v)
+		local t = type(v)
+		if t == "string" or t == "number" or t == "boolean" or t == "nil" then
+			return v
+		end
+		return tostring(v)
+	end
+
+	-- Pack raw arguments, the logger formats them (see ltask.log.format)
+	local function pushlog(level, fmt, ...)
+		local n = select("#", ...)
+		for i = 1, n do
+			local t = type((select(i, ...)))
+			if t ~= "string" and t ~= "number" and t ~= "boolean" and t ~= "nil" then
+				-- rare : tostring the values can't be packed
+				local args = table.pack(...)
+				for j = i, n do
+					args[j] = log_value(args[j])
+				end
+				ltask.pushlog(level, fmt, CURRENT_SERVICE_LABEL, table.unpack(args, 1, n))
+				return
+			end
+		end
+		-- packed in ltask.pushlog after the rate limits (config.log_rate, etc.)
+		ltask.pushlog(level, fmt, CURRENT_SERVICE_LABEL, ...)
+	end
+
+	for level, id in pairs(LOG_LEVEL) do
+		-- ltask.log.info(...) : tostring and join the arguments with tab
+		ltask.log[level] = function (...)
+			if id >= log_level then
+				pushlog(level, false, ...)
+			end
+		end
+		-- ltask.log.infof(fmt, ...) : string.format(fmt, ...)
+		ltask.log[level .. "f"] = function (fmt, ...)
+			if id >= log_level then
+				pushlog(level, fmt, ...)
+			end
+		end
+	end
+
+	-- set the lowest level to log, returns the last level
+	function ltask.log.level(level)
+		local last
+		for name, id in pairs(LOG_LEVEL) do
+			if id == log_level then
+				last = name
+			end
+		end
+		if level then
+			log_level = LOG_LEVEL[level] or error("Invalid log level " .. tostring(level))
 		end
-		local message = string.format("( %s ) %s", CURRENT_SERVICE_LABEL, table.concat(str, "\t"))
-		ltask.pushlog(ltask.pack(level, message))
+		return last
+	end
+
+	local function format_message(level, fmt, ...)
+		local n = select("#", ...)
+		if n == 0 then
+			-- (level, message), from bootstrap
+			return level, fmt
+		end
+		local label = ...
+		local message
+		if fmt then
+			local ok, r = pcall(string.format, fmt, select(2, ...))
+			message = ok and r or (fmt .. " (" .. r .. ")")
+		else
+			local t = table.pack(select(2, ...))
+			for i = 1, t.n do
+				t[i] = tostring(t[i])
+			end
+			message = table.concat(t, "\t", 1, t.n)
+		end
+		return level, string.format("( %s ) %s", label, message)
+	end
+
+	-- returns level, message
+	function ltask.log.format(msg, sz)
+		return format_message(ltask.unpack_remove(msg, sz))
 	end
 end
 
@@ -54,6 +130,8 @@ local running_thread
 local session_coroutine_suspend_lookup = {}
 local session_coroutine_response = {}
 local session_coroutine_address = {}
+local session_coroutine_trace = {}	-- { trace, span, parent, start }, see ltask.trace_begin
+local session_timer = {}	-- session -> timer handle of ltask.timeout
 local session_id = 2	-- 1 is reserved for root
 
 local session_waiting = {}
@@ -233,8 +311,8 @@ local function rethrow_error(level, errobj)
 	end
 end
 
-function ltask.post_message(addr, session, type, msg, sz)
-	ltask.send_message(addr, session, type, msg, sz)
+function ltask.post_message(addr, session, type, msg, sz, trace, span)
+	ltask.send_message(addr, session, type, msg, sz, trace, span)
 	continue_session()
 	return ltask.message_receipt()
 end
@@ -256,7 +334,13 @@ local function send_blocked_message(addr, session, type, ...)
 end
 
 local function post_request_message(addr, session, type, msg, sz)
-	local receipt_type, receipt_msg, receipt_sz = ltask.post_message(addr, session, type, msg, sz)
+	local receipt_type, receipt_msg, receipt_sz
+	local ctx = session_coroutine_trace[running_thread]
+	if ctx then
+		receipt_type, receipt_msg, receipt_sz = ltask.post_message(addr, session, type, msg, sz, ctx.trace, ctx.span)
+	else
+		receipt_type, receipt_msg, receipt_sz = ltask.post_message(addr, session, type, msg, sz)
+	end
 	if receipt_type == RECEIPT_DONE then
 		return
 	end
@@ -288,6 +372,22 @@ local function post_response_message(addr, session, type, msg, sz)
 	end
 end
 
+local function begin_span(co, trace, parent)
+	local span, start = ltask.span_new()
+	if span then
+		session_coroutine_trace[co] = { trace = trace or span, span = span, parent = parent, start = start }
+	end
+	return span
+end
+
+local function end_span(co)
+	local ctx = session_coroutine_trace[co]
+	if ctx and ctx.start then
+		ltask.span_record(ctx.trace, ctx.span, ctx.parent, ctx.start)
+		ctx.start = nil
+	end
+end
+
 function ltask.raise_error(addr, session, message)
 	if session == SESSION_SEND_MESSAGE then
 		return
@@ -309,6 +409,8 @@ local function resume_session(co, ...)
 		-- term session
 		session_coroutine_address[co] = nil
 		session_coroutine_response[co] = nil
+		end_span(co)
+		session_coroutine_trace[co] = nil
 
 		errobj = traceback(errobj, co)
 		if from == nil or from == 0 or session == SESSION_SEND_MESSAGE then
@@ -337,6 +439,9 @@ local function new_thread(f)
 			f(...)
 			while true do
 				f = nil
+				-- the span of a fork ends with it, see ltask.fork
+				end_span(co)
+				session_coroutine_trace[co] = nil
 				coroutine_pool[#coroutine_pool+1] = co
 				f = coroutine_yield()
 				f(coroutine_yield())
@@ -368,6 +473,7 @@ local function send_response(...)
 	-- End session
 	session_coroutine_address[running_thread] = nil
 	session_coroutine_response[running_thread] = nil
+	end_span(running_thread)
 end
 
 ------------- ltask lua api
@@ -496,17 +602,34 @@ function ltask.thread_info(thread)
 	return v
 end
 
+-- returns a token for ltask.cancel_timeout
 function ltask.timeout(ti, func)
 	local co = new_thread(func)
-	session_coroutine_suspend_lookup[session_id] = co
+	local session = session_id
+	session_coroutine_suspend_lookup[session] = co
 	if ti == 0 then
-		if RECEIPT_DONE ~= ltask.post_message(CURRENT_SERVICE, session_id, MESSAGE_RESPONSE) then
-			ltask.timer_add(session_id, 0)
+		if RECEIPT_DONE ~= ltask.post_message(CURRENT_SERVICE, session, MESSAGE_RESPONSE) then
+			session_timer[session] = ltask.timer_add(session, 0)
 		end
 	else
-		ltask.timer_add(session_id, ti)
+		session_timer[session] = ltask.timer_add(session, ti)
 	end
 	session_id = session_id + 1
+	return session
+end
+
+-- returns true if func of ltask.timeout will not be called
+function ltask.cancel_timeout(session)
+	local handle = session_timer[session]
+	if handle == nil or not ltask.timer_cancel(handle) then
+		-- too late, the response is on the way
+		return false
+	end
+	session_timer[session] = nil
+	local co = session_coroutine_suspend_lookup[session]
+	session_coroutine_suspend_lookup[session] = nil
+	coroutine_close(co)
+	return true
 end
 
 local function wait_interrupt(errobj)
@@ -591,10 +714,28 @@ end
 
 function ltask.fork(func, ...)
 	local co = new_thread(func)
+	-- forked coroutine has its own span, as a child of the current one
+	local ctx = session_coroutine_trace[running_thread]
+	if ctx then
+		begin_span(co, ctx.trace, ctx.span)
+	end
 	wakeup_queue[#wakeup_queue+1] = {co, ...}
 	return co
 end
 
+do	-- profile
+	local profile = ltask.profile
+	-- the coroutines created from now on inherit the sampling hook, so drop the pooled ones
+	function ltask.profile(interval)
+		if interval then
+			for i = #coroutine_pool, 1, -1 do
+				coroutine_pool[i] = nil
+			end
+		end
+		return profile(interval)
+	end
+end
+
 function ltask.current_session()
 	local from = session_coroutine_address[running_thread]
 	local session = session_coroutine_response[running_thread]
@@ -605,6 +746,17 @@ function ltask.no_response()
 	session_coroutine_response[running_thread] = nil
 end
 
+-- Start a traced call chain in the current session, returns the trace id (nil if trace is disabled).
+-- ltask.call/send carry the trace context, and each request handler records a span.
+function ltask.trace_begin()
+	return begin_span(running_thread, nil, 0)
+end
+
+function ltask.trace_end()
+	end_span(running_thread)
+	session_coroutine_trace[running_thread] = nil
+end
+
 function ltask.servicepath(path)
     return ltask.call(SERVICE_ROOT, "servicepath", path)
 end
@@ -625,6 +777,13 @@ function ltask.spawn_service(name, ...)
     return ltask.call(SERVICE_ROOT, "spawn_service", name, ...)
 end
 
+-- Change the number of active workers, only root and the bootstrap services can do it.
+-- The services bound (ltask.worker_bind) to a retired worker run on the other workers,
+-- and they are bound again when the worker is back.
+function ltask.worker_resize(n)
+	return ltask.call(SERVICE_ROOT, "worker_resize", n)
+end
+
 function ltask.parallel(task)
 	local n = #task
 	if n == 0 then
@@ -864,6 +1023,22 @@ function sys_service.memory()
 	return collectgarbage "count" * 1024
 end
 
+function sys_service.latency()
+	return ltask.latency()
+end
+
+function sys_service.log_level(level)
+	return ltask.log.level(level)
+end
+
+function sys_service.profile(interval)
+	return ltask.profile(interval)
+end
+
+function sys_service.profile_dump()
+	return ltask.profile_dump()
+end
+
 function sys_service.traceback()
 	local tlog = {}
 	local n = 1
@@ -900,22 +1075,22 @@ SESSION[MESSAGE_REQUEST] = function (type, msg, sz)
 	request(ltask.unpack_remove(msg, sz))
 end
 
-local function schedule_message()
-	local from, session, type, msg, sz = ltask.recv_message()
+local function dispatch_message(from, session, type, msg, sz, trace, span)
 	local f = SESSION[type]
 	if f then
 		-- new session for this message
 		local co = new_session(f, from, session)
+		if trace ~= 0 then
+			begin_span(co, trace, span)
+		end
 		wakeup_session(co, type, msg, sz)
-	elseif from == nil then
-		-- no message
-		return
 	else
 		local co = session_coroutine_suspend_lookup[session]
 		if co == nil then
 			print("Unknown response session : ", session, "from", from, "type", type, ltask.unpack_remove(msg, sz))
 		else
 			session_coroutine_suspend_lookup[session] = nil
+			session_timer[session] = nil
 			wakeup_session(co, type, session, msg, sz)
 		end
 	end
@@ -925,6 +1100,38 @@ local function schedule_message()
 	end
 end
 
+local RECV_BATCH <const> = 32
+local RECV_STRIDE <const> = 7
+local recv_buffer = {}
+
+local function reject_messages(from_index, n)
+	-- quit in the middle of a batch, reject the rest as root does in close_service
+	local buf = recv_buffer
+	for i = from_index, n - 1 do
+		local b = i * RECV_STRIDE
+		local from, session, type, msg, sz = buf[b+1], buf[b+2], buf[b+3], buf[b+4], buf[b+5]
+		if type == MESSAGE_REQUEST or type == MESSAGE_SYSTEM then
+			ltask.raise_error(from, session, "Service has been quit.")
+		end
+		if msg then
+			ltask.remove(msg, sz)
+		end
+	end
+end
+
+local function schedule_message()
+	local buf = recv_buffer
+	local n = ltask.recv_messages(buf, RECV_BATCH)
+	for i = 0, n - 1 do
+		local b = i * RECV_STRIDE
+		dispatch_message(buf[b+1], buf[b+2], buf[b+3], buf[b+4], buf[b+5], buf[b+6], buf[b+7])
+		if quit then
+			reject_messages(i + 1, n)
+			return
+		end
+	end
+end
+
 print = ltask.log.info
 
 local function mainloop()
@@ -23,6 +23,10 @@ local named_services = {}
 
 local root_quit = ltask.quit
 ltask.quit = function() end
+ltask.worker_resize = root.worker_resize
+
+-- the services in config.bootstrap, they can do what root does
+local system_services = {}
 
 local function writelog()
 	while true do
@@ -32,7 +36,7 @@ local function writelog()
 		end
 		local tsec = ti // 100
 		local msec = ti % 100
-		local level, message = ltask.unpack_remove(msg, sz)
+		local level, message = ltask.log.format(msg, sz)
 		io.write(string.format("[%s.%02d][%-5s]%s\n", os.date("%Y-%m-%d %H:%M:%S", tsec), msec, level:upper(), message))
 	end
 end
@@ -118,14 +122,15 @@ local function register_service(address, name)
 	ltask.multi_wakeup("unique."..name, address)
 end
 
-local function spawn(t)
+local function spawn(t, system)
 	local type, address = ltask.post_message(SERVICE_SYSTEM, 0, MESSAGE_SCHEDULE_NEW)
 	if type ~= RECEIPT_RESPONSE then
 		-- RECEIPT_ERROR
 		error("send MESSAGE_SCHEDULE_NEW failed.")
 	end
 	anonymous_services[address] = true
-	assert(root.init_service(address, t.name, config.service_source, config.service_chunkname, t.worker_id))
+	system_services[address] = system
+	assert(root.init_service(address, t.name, config.service_source, config.service_chunkname, t.worker_id, t.group))
 	ltask.syscall(address, "init", {
 		initfunc = t.initfunc or config.initfunc,
 		name = t.name,
@@ -137,27 +142,31 @@ end
 
 local unique = {}
 
-local function spawn_unique(t)
+local function spawn_unique(t, system)
 	local address = named_services[t.name]
-	if address then
-		return address
-	end
-	local key = "unique."..t.name
-	if not unique[t.name] then
-		unique[t.name] = true
-		ltask.fork(function ()
-			local ok, addr = pcall(spawn, t)
-			if not ok then
-				local err = addr
-				ltask.multi_interrupt(key, err)
+	if not address then
+		local key = "unique."..t.name
+		if not unique[t.name] then
+			unique[t.name] = true
+			ltask.fork(function ()
+				local ok, addr = pcall(spawn, t, system)
+				if not ok then
+					local err = addr
+					ltask.multi_interrupt(key, err)
+					unique[t.name] = nil
+					return
+				end
+				register_service(addr, t.name)
 				unique[t.name] = nil
-				return
-			end
-			register_service(addr, t.name)
-			unique[t.name] = nil
-		end)
+			end)
+		end
+		address = ltask.multi_wait(key)
+	end
+	-- the service may be spawned by someone else
+	if system then
+		system_services[address] = true
 	end
-	return ltask.multi_wait(key)
+	return address
 end
 
 function S.tracelog(timeout)
@@ -192,6 +201,50 @@ function S.tracelog(timeout)
 	return tlog
 end
 
+local function all_services(cmd, timeout, arg)
+	local result = {}
+	local tasks = {}
+	local n = 1
+	for addr in pairs(anonymous_services) do
+		tasks[n] = { ltask.syscall, addr, cmd, arg, addr = addr } ; n = n + 1
+		result[addr] = {}
+	end
+	for _, name in ipairs(named_services) do
+		local addr = named_services[name]
+		tasks[n] = { ltask.syscall, addr, cmd, arg, addr = addr } ; n = n + 1
+		result[addr] = { name = name }
+	end
+	if timeout then
+		tasks[n] = { ltask.sleep, timeout }
+	end
+
+	for req, resp in ltask.parallel(tasks) do
+		if not req.addr then
+			-- timeout
+			break
+		end
+		if not resp.error then
+			result[req.addr].result = resp[1]
+		else
+			result[req.addr].error = resp.error
+		end
+	end
+	return result
+end
+
+-- interval : ms of cpu time, 0 : stop
+function S.profile(interval, timeout)
+	ltask.profile(interval)
+	return all_services("profile", timeout, interval)
+end
+
+-- folded stacks of each service
+function S.profile_dump(timeout)
+	local r = all_services("profile_dump", timeout)
+	r[1] = { name = "root", result = ltask.profile_dump() }
+	return r
+end
+
 local SERVICE_PATH
 
 function S.servicepath(path)
@@ -231,6 +284,7 @@ function S.spawn_service(t)
 end
 
 local function del_service(address)
+	system_services[address] = nil
 	if anonymous_services[address] then
 		anonymous_services[address] = nil
 	else
@@ -252,6 +306,14 @@ local function del_service(address)
 	end
 end
 
+function S.worker_resize(n)
+	local from = ltask.current_session().from
+	if not system_services[from] then
+		error(("Service %d can't resize workers"):format(from))
+	end
+	return root.worker_resize(n)
+end
+
 function S.quit_ltask()
 	ltask.signal_handler(del_service)
 	for i = #named_services, 1, -1 do
@@ -296,7 +358,11 @@ ltask.signal_handler(signal_handler)
 
 local function bootstrap()
 	for _, t in ipairs(config.bootstrap) do
-		S.spawn_service(t)
+		if t.unique then
+			spawn_unique(t, true)
+		else
+			spawn(t, true)
+		end
 	end
 end
 
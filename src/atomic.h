@@ -5,7 +5,12 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 typedef atomic_uintptr_t atomic_ptr;
+typedef atomic_uint_least64_t atomic_u64;
 
 static inline void
 atomic_int_init(atomic_int *aint, int v) {
@@ -32,6 +37,21 @@ atomic_int_dec(atomic_int *aint) {
 	return atomic_fetch_sub(aint, 1)-1;
 }
 
+static inline int
+atomic_int_exchange(atomic_int *aint, int v) {
+	return atomic_exchange(aint, v);
+}
+
+static inline int
+atomic_int_or(atomic_int *aint, int v) {
+	return atomic_fetch_or(aint, v);
+}
+
+static inline int
+atomic_int_and(atomic_int *aint, int v) {
+	return atomic_fetch_and(aint, v);
+}
+
 static inline int
 atomic_int_cas(atomic_int *aint, int oval, int nval) {
 	return atomic_compare_exchange_weak(aint, &oval, nval);
@@ -58,4 +78,41 @@ atomic_ptr_cas(atomic_ptr *aptr, void *oval, void *nval) {
 	return atomic_compare_exchange_weak(aptr, &temp, (uintptr_t)nval);
 }
 
+static inline void
+atomic_u64_init(atomic_u64 *a, uint64_t v) {
+	atomic_init(a, v);
+}
+
+static inline uint64_t
+atomic_u64_load(atomic_u64 *a) {
+	return atomic_load_explicit(a, memory_order_relaxed);
+}
+
+static inline void
+atomic_u64_store(atomic_u64 *a, uint64_t v) {
+	atomic_store_explicit(a, v, memory_order_relaxed);
+}
+
+static inline uint64_t
+atomic_u64_add(atomic_u64 *a, uint64_t v) {
+	return atomic_fetch_add_explicit(a, v, memory_order_relaxed);
+}
+
+// *oval is updated when fail
+static inline int
+atomic_u64_cas(atomic_u64 *a, uint64_t *oval, uint64_t nval) {
+	return atomic_compare_exchange_weak_explicit(a, oval, nval, memory_order_relaxed, memory_order_relaxed);
+}
+
+static inline void
+atomic_pause(void) {
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	_mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
 #endif
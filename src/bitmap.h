@@ -0,0 +1,85 @@
+#ifndef ltask_bitmap_h
+#define ltask_bitmap_h
+
+#include "atomic.h"
+#include "config.h"
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+static inline int
+bitmap_ctz(unsigned int v) {
+	unsigned long index;
+	_BitScanForward(&index, v);
+	return (int)index;
+}
+
+#else
+
+#define bitmap_ctz __builtin_ctz
+
+#endif
+
+#define BITMAP_WORD 32
+#define BITMAP_SIZE ((MAX_WORKER + BITMAP_WORD - 1) / BITMAP_WORD)
+
+// One bit per worker, set and clear are atomic.
+// Bits are hints, always check the real state of the worker.
+
+struct bitmap {
+	atomic_int bits[BITMAP_SIZE];
+};
+
+static inline void
+bitmap_init(struct bitmap *b) {
+	int i;
+	for (i=0;i<BITMAP_SIZE;i++) {
+		atomic_int_init(&b->bits[i], 0);
+	}
+}
+
+static inline void
+bitmap_set(struct bitmap *b, int index) {
+	atomic_int_or(&b->bits[index / BITMAP_WORD], (int)(1u << (index % BITMAP_WORD)));
+}
+
+static inline void
+bitmap_clear(struct bitmap *b, int index) {
+	atomic_int_and(&b->bits[index / BITMAP_WORD], (int)~(1u << (index % BITMAP_WORD)));
+}
+
+static inline int
+bitmap_test(struct bitmap *b, int index) {
+	return ((unsigned int)atomic_int_load(&b->bits[index / BITMAP_WORD]) >> (index % BITMAP_WORD)) & 1;
+}
+
+// The first set bit at or after index, -1 if none
+static inline int
+bitmap_next(struct bitmap *b, int index, int n) {
+	int w = index / BITMAP_WORD;
+	if (index >= n)
+		return -1;
+	unsigned int bits = (unsigned int)atomic_int_load(&b->bits[w]) & (~0u << (index % BITMAP_WORD));
+	for (;;) {
+		if (bits) {
+			index = w * BITMAP_WORD + bitmap_ctz(bits);
+			return index < n ? index : -1;
+		}
+		if (++w >= (n + BITMAP_WORD - 1) / BITMAP_WORD)
+			return -1;
+		bits = (unsigned int)atomic_int_load(&b->bits[w]);
+	}
+}
+
+static inline int
+bitmap_count(struct bitmap *b, int n) {
+	int count = 0;
+	int i = -1;
+	while ((i = bitmap_next(b, i+1, n)) >= 0) {
+		++count;
+	}
+	return count;
+}
+
+#endif
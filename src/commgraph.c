@@ -0,0 +1,166 @@
+#include "commgraph.h"
+#include "atomic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define EDGE_SIZE 4096
+#define EDGE_PROBE 8
+#define DECAY_SAMPLE 65536
+
+struct edge {
+	unsigned int from;
+	unsigned int to;
+	unsigned int count;
+};
+
+struct node {
+	unsigned int id;
+	unsigned int peer;
+	unsigned int weight;
+};
+
+struct commgraph {
+	int sample;
+	int tick;
+	int decay;
+	int node_mask;
+	atomic_int edges;	// edges in use
+	struct edge e[EDGE_SIZE];
+	struct node n[1];
+};
+
+struct commgraph *
+commgraph_new(int sample, int max_service) {
+	if (sample <= 0)
+		return NULL;
+	size_t sz = sizeof(struct commgraph) + (max_service - 1) * sizeof(struct node);
+	struct commgraph *g = (struct commgraph *)malloc(sz);
+	if (g == NULL)
+		return NULL;
+	memset(g, 0, sz);
+	atomic_int_init(&g->edges, 0);
+	g->sample = sample;
+	g->node_mask = max_service - 1;
+	return g;
+}
+
+void
+commgraph_delete(struct commgraph *g) {
+	free(g);
+}
+
+static inline unsigned int
+edge_hash(unsigned int from, unsigned int to) {
+	unsigned int h = from * 0x9e3779b1u ^ to * 0x85ebca6bu;
+	return h ^ (h >> 16);
+}
+
+static void
+decay(struct commgraph *g) {
+	int i;
+	for (i=0;i<EDGE_SIZE;i++) {
+		struct edge *e = &g->e[i];
+		if (e->count == 0)
+			continue;
+		e->count /= 2;
+		if (e->count == 0) {
+			e->from = 0;
+			e->to = 0;
+			atomic_int_dec(&g->edges);
+		}
+	}
+	for (i=0;i<=g->node_mask;i++) {
+		g->n[i].weight /= 2;
+	}
+}
+
+// NULL : no room for a new edge
+static struct edge *
+find_edge(struct commgraph *g, unsigned int from, unsigned int to) {
+	unsigned int h = edge_hash(from, to);
+	struct edge *victim = NULL;
+	int i;
+	for (i=0;i<EDGE_PROBE;i++) {
+		struct edge *e = &g->e[(h + i) & (EDGE_SIZE - 1)];
+		if (e->from == from && e->to == to)
+			return e;
+		if (victim == NULL || e->count < victim->count)
+			victim = e;
+	}
+	if (victim->count == 0) {
+		atomic_int_inc(&g->edges);
+	} else if (--victim->count > 0) {
+		// all the slots nearby are in use, age the coldest one instead of evicting a hot edge
+		return NULL;
+	}
+	// the coldest one is gone
+	victim->from = from;
+	victim->to = to;
+	victim->count = 0;
+	return victim;
+}
+
+static void
+update_peer(struct commgraph *g, unsigned int id, unsigned int peer, unsigned int weight) {
+	struct node *n = &g->n[id & g->node_mask];
+	if (n->id != id) {
+		n->id = id;
+		n->peer = peer;
+		n->weight = weight;
+	} else if (n->peer == peer || weight > n->weight) {
+		n->peer = peer;
+		n->weight = weight;
+	}
+}
+
+void
+commgraph_add(struct commgraph *g, service_id from, service_id to) {
+	if (++g->tick < g->sample)
+		return;
+	g->tick = 0;
+	if (from.id == to.id || from.id == SERVICE_ID_SYSTEM || to.id == SERVICE_ID_SYSTEM)
+		return;
+	struct edge *e = find_edge(g, from.id, to.id);
+	if (e) {
+		++e->count;
+		update_peer(g, from.id, to.id, e->count);
+		update_peer(g, to.id, from.id, e->count);
+	}
+	if (++g->decay >= DECAY_SAMPLE) {
+		g->decay = 0;
+		decay(g);
+	}
+}
+
+service_id
+commgraph_peer(struct commgraph *g, service_id id) {
+	service_id peer = { 0 };
+	struct node *n = &g->n[id.id & g->node_mask];
+	if (n->id == id.id && n->weight > 0)
+		peer.id = n->peer;
+	return peer;
+}
+
+int
+commgraph_size(struct commgraph *g) {
+	return atomic_int_load(&g->edges);
+}
+
+int
+commgraph_edges(struct commgraph *g, struct commgraph_edge *e, int n) {
+	int i;
+	int count = 0;
+	for (i=0;i<EDGE_SIZE;i++) {
+		struct edge *s = &g->e[i];
+		if (s->count == 0)
+			continue;
+		if (count < n) {
+			e[count].from.id = s->from;
+			e[count].to.id = s->to;
+			e[count].count = s->count;
+		}
+		++count;
+	}
+	return count;
+}
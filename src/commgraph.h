@@ -0,0 +1,26 @@
+#ifndef ltask_commgraph_h
+#define ltask_commgraph_h
+
+#include "service.h"
+
+// Sampled message counts between services, only the scheduler writes it.
+
+struct commgraph;
+
+struct commgraph_edge {
+	service_id from;
+	service_id to;
+	unsigned int count;
+};
+
+struct commgraph * commgraph_new(int sample, int max_service);
+void commgraph_delete(struct commgraph *g);
+void commgraph_add(struct commgraph *g, service_id from, service_id to);
+// the service talks most frequently with, 0 if unknown
+service_id commgraph_peer(struct commgraph *g, service_id id);
+// the number of edges, it changes unless the scheduler is held
+int commgraph_size(struct commgraph *g);
+// copy at most n edges, returns the number of all edges. hold the scheduler when calling it
+int commgraph_edges(struct commgraph *g, struct commgraph_edge *e, int n);
+
+#endif
@@ -19,6 +19,177 @@ config_getint(lua_State *L, int index, const char *key, int opt) {
 	return r;
 }
 
+static int
+config_getbool(lua_State *L, int index, const char *key, int opt) {
+	int t = lua_getfield(L, index, key);
+	if (t == LUA_TNIL) {
+		lua_pop(L, 1);
+		return opt;
+	}
+	if (t != LUA_TBOOLEAN) {
+		return luaL_error(L, ".%s should be a boolean", key);
+	}
+	int r = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return r;
+}
+
+// empty string if not found or too long
+static void
+config_getstring(lua_State *L, int index, const char *key, char *buf, size_t bufsz) {
+	buf[0] = 0;
+	if (lua_getfield(L, index, key) == LUA_TSTRING) {
+		size_t sz;
+		const char *str = lua_tolstring(L, -1, &sz);
+		if (sz < bufsz) {
+			memcpy(buf, str, sz+1);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+#define MAX_CPU 1024
+
+static int
+cpu_node(const struct sysinfo_cpu *cpu, int n, int id) {
+	int i;
+	for (i=0;i<n;i++) {
+		if (cpu[i].id == id)
+			return cpu[i].node;
+	}
+	return 0;
+}
+
+// .cpu = { cpu list } or .pin = true to pin workers to cpus, .smt = false to skip SMT siblings, .numa = false to ignore nodes
+static void
+config_cpu(lua_State *L, int index, struct ltask_config *config, int default_worker) {
+	int i;
+	for (i=0;i<MAX_WORKER;i++) {
+		config->cpu[i] = -1;
+		config->node[i] = 0;
+	}
+	config->pin = 0;
+	int smt = config_getbool(L, index, "smt", 1);
+	int pin = config_getbool(L, index, "pin", 0);
+	int cpu_list = lua_getfield(L, index, "cpu") == LUA_TTABLE;
+	if (!cpu_list && !pin && smt) {
+		// no need of the topology
+		lua_pop(L, 1);
+		return;
+	}
+	struct sysinfo_cpu cpu[MAX_CPU];
+	int n = sysinfo_topology(cpu, MAX_CPU);
+	if (!smt) {
+		// sorted by core, keep the first cpu of each core
+		int c = 0;
+		for (i=0;i<n;i++) {
+			if (c == 0 || cpu[c-1].core != cpu[i].core || cpu[c-1].node != cpu[i].node) {
+				cpu[c++] = cpu[i];
+			}
+		}
+		n = c;
+	}
+	if (default_worker && n > 1 && n - 1 < config->worker) {
+		// one worker per cpu (per core if .smt = false), and one for the main thread
+		config->worker = n - 1;
+	}
+	if (cpu_list) {
+		int cpu_n = (int)lua_rawlen(L, -1);
+		if (cpu_n == 0) {
+			luaL_error(L, ".cpu is empty");
+			return;
+		}
+		for (i=0;i<MAX_WORKER;i++) {
+			if (lua_rawgeti(L, -1, i % cpu_n + 1) != LUA_TNUMBER || !lua_isinteger(L, -1)) {
+				luaL_error(L, ".cpu should be a list of integers");
+				return;
+			}
+			int id = (int)lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			config->cpu[i] = id;
+			config->node[i] = cpu_node(cpu, n, id);
+		}
+		config->pin = 1;
+	} else if (pin && n > 0) {
+		// workers of the same node are adjacent
+		for (i=0;i<MAX_WORKER;i++) {
+			config->cpu[i] = cpu[i % n].id;
+			config->node[i] = cpu[i % n].node;
+		}
+		config->pin = 1;
+	}
+	lua_pop(L, 1);
+	if (!config_getbool(L, index, "numa", 1)) {
+		for (i=0;i<MAX_WORKER;i++) {
+			config->node[i] = 0;
+		}
+	}
+}
+
+// .group = { { name = "io", worker = 2, steal = false }, ... }, the rest workers are in "default" group
+static void
+config_groups(lua_State *L, int index, struct ltask_config *config) {
+	config->group_n = 1;
+	strcpy(config->group[0].name, "default");
+	config->group[0].steal = 0;
+	memset(config->worker_group, 0, sizeof(config->worker_group));
+	if (lua_getfield(L, index, "group") == LUA_TTABLE) {
+		int n = (int)lua_rawlen(L, -1);
+		int worker = 0;
+		int i;
+		for (i=1;i<=n;i++) {
+			if (lua_rawgeti(L, -1, i) != LUA_TTABLE) {
+				luaL_error(L, ".group[%d] should be a table", i);
+				return;
+			}
+			int g = lua_gettop(L);
+			if (lua_getfield(L, g, "name") != LUA_TSTRING) {
+				luaL_error(L, ".group[%d].name should be a string", i);
+				return;
+			}
+			size_t sz;
+			const char *name = lua_tolstring(L, -1, &sz);
+			int gid = config_group(config, name);
+			if (gid < 0) {
+				if (config->group_n >= MAX_GROUP) {
+					luaL_error(L, "Too many groups");
+					return;
+				}
+				if (sz >= sizeof(config->group[0].name)) {
+					luaL_error(L, "Group name %s is too long", name);
+					return;
+				}
+				gid = config->group_n++;
+				memcpy(config->group[gid].name, name, sz+1);
+			}
+			lua_pop(L, 1);
+			config->group[gid].steal = config_getbool(L, g, "steal", 0);
+			int count = config_getint(L, g, "worker", 0);
+			if (gid > 0) {
+				while (count-- > 0 && worker < config->worker) {
+					config->worker_group[worker++] = gid;
+				}
+			}
+			lua_pop(L, 1);
+		}
+		if (worker >= config->worker) {
+			luaL_error(L, "No worker for the default group");
+			return;
+		}
+	}
+	lua_pop(L, 1);
+}
+
+int
+config_group(const struct ltask_config *config, const char *name) {
+	int i;
+	for (i=0;i<config->group_n;i++) {
+		if (strcmp(config->group[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
 static inline int
 align_pow2(int x) {
 	int r = 1;
@@ -37,34 +208,56 @@ config_load(lua_State *L, int index, struct ltask_config *config) {
 		luaL_error(L, "Need at least 2 cores");
 		return;
 	}
+	int default_worker = 0;
 	if (config->worker == 0) {
 		config->worker = ncores - 1;
+		default_worker = 1;
 	}
 	if (config->worker > MAX_WORKER) {
 		config->worker = MAX_WORKER;
 	}
+	config_cpu(L, index, config, default_worker);
+	// workers can be added at runtime up to worker_max
+	config->worker_max = config_getint(L, index, "worker_max", config->worker > ncores ? config->worker : ncores);
+	if (config->worker_max < config->worker) {
+		config->worker_max = config->worker;
+	}
+	if (config->worker_max > MAX_WORKER) {
+		config->worker_max = MAX_WORKER;
+	}
+	config_groups(L, index, config);
 	config->queue = config_getint(L, index, "queue", DEFAULT_QUEUE);
 	config->queue = align_pow2(config->queue);
 	config->queue_sending = config_getint(L, index, "queue_sending", DEFAULT_QUEUE_SENDING);
 	config->queue_sending = align_pow2(config->queue_sending);
 	config->max_service = config_getint(L, index, "max_service", DEFAULT_MAX_SERVICE);
 	config->external_queue = config_getint(L, index, "external_queue", 0);
+	config->commgraph = config_getint(L, index, "commgraph", 0);
+	config->spin = config_getint(L, index, "spin", 0);
+	config->edf = config_getbool(L, index, "edf", 0);
+	config->edf_burst = config_getint(L, index, "edf_burst", DEFAULT_EDF_BURST);
+	if (config->edf_burst < 1)
+		config->edf_burst = 1;
+	config->histogram = config_getbool(L, index, "histogram", 0);
+	config->trace = config_getbool(L, index, "trace", 0);
+	config->trace_size = config_getint(L, index, "trace_size", DEFAULT_TRACE_SIZE);
+	config->watchdog = config_getint(L, index, "watchdog", 0);
+	config->watchdog_preempt = config_getbool(L, index, "watchdog_preempt", 0);
+	if (config->trace_size > 0)
+		config->trace_size = align_pow2(config->trace_size);
 	config->max_service = align_pow2(config->max_service);
-	if (lua_getfield(L, index, "crashlog") != LUA_TSTRING) {
-		config->crashlog[0] = 0;
-	} else {
-		size_t sz;
-		const char *log = lua_tolstring(L, -1, &sz);
-		if (sz >= sizeof(config->crashlog)) {
-			// filename is too long
-			config->crashlog[0] = 0;
-		} else {
-			memcpy(config->crashlog, log, sz+1);
-		}
-	}
+	config_getstring(L, index, "crashlog", config->crashlog, sizeof(config->crashlog));
+	config_getstring(L, index, "logfile", config->logfile, sizeof(config->logfile));
+	config->logfile_size = config_getint(L, index, "logfile_size", 0);
+	config->log_rate = config_getint(L, index, "log_rate", 0);
+	config->log_site_rate = config_getint(L, index, "log_site_rate", 0);
+	config->log_sample = config_getint(L, index, "log_sample", 0);
+	config->log_summary = config_getint(L, index, "log_summary", DEFAULT_LOG_SUMMARY);
 	
 	lua_pushinteger(L, config->worker);
 	lua_setfield(L, index, "worker");
+	lua_pushinteger(L, config->worker_max);
+	lua_setfield(L, index, "worker_max");
 	lua_pushinteger(L, config->queue);
 	lua_setfield(L, index, "queue");
 	lua_pushinteger(L, config->max_service);
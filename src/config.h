@@ -6,18 +6,51 @@
 #define DEFAULT_MAX_SERVICE 65536
 #define DEFAULT_QUEUE 4096
 #define DEFAULT_QUEUE_SENDING DEFAULT_QUEUE
+#define DEFAULT_TRACE_SIZE 4096
+#define DEFAULT_EDF_BURST 8
+#define DEFAULT_LOG_SUMMARY 10
 #define MAX_WORKER 256
 #define MAX_SOCKEVENT 16
+#define MAX_GROUP 8
+
+struct ltask_group {
+	char name[32];
+	int steal;	// workers of the group can run services of other groups
+};
 
 struct ltask_config {
 	int worker;
+	int worker_max;
 	int queue;
 	int queue_sending;
 	int max_service;
 	int external_queue;
+	int commgraph;
+	int spin;
+	int edf;	// services with a deadline run first, earliest deadline first
+	int edf_burst;	// at most edf_burst deadline services in a row before a FIFO one, so FIFO services don't starve
+	int histogram;	// record latency histograms
+	int trace;	// trace events at startup
+	int trace_size;	// events of each trace ring, 0 : no trace
+	int watchdog;	// ms a service may run without yielding, 0 : no watchdog
+	int watchdog_preempt;	// raise an error in the service which runs too long
+	int pin;	// workers are pinned to cpus
+	int cpu[MAX_WORKER];	// cpu of each worker, -1 : not pinned
+	int node[MAX_WORKER];	// NUMA node of each worker
+	int group_n;
+	struct ltask_group group[MAX_GROUP];	// group 0 is "default"
+	unsigned char worker_group[MAX_WORKER];
+	int log_rate;	// logs per second of a service, 0 : unlimited
+	int log_site_rate;	// logs per second of a call site, 0 : unlimited
+	int log_sample;	// keep one of every log_sample logs over the limit
+	int log_summary;	// seconds between dropped log summaries
+	int logfile_size;	// rotate logfile when it's larger than it, 0 : never
 	char crashlog[128];
+	char logfile[128];	// write logs by a native thread instead of logger service
 };
 
 void config_load(lua_State *L, int index, struct ltask_config *config);
+// -1 : not found
+int config_group(const struct ltask_config *config, const char *name);
 
 #endif
@@ -0,0 +1,73 @@
+#include "edf.h"
+
+#include <stdlib.h>
+
+struct edf_node {
+	uint64_t deadline;
+	int id;
+};
+
+struct edf_queue {
+	int size;
+	int n;
+	struct edf_node heap[1];
+};
+
+struct edf_queue *
+edf_new(int size) {
+	struct edf_queue *q = (struct edf_queue *)malloc(sizeof(*q) + (size - 1) * sizeof(struct edf_node));
+	if (q == NULL)
+		return NULL;
+	q->size = size;
+	q->n = 0;
+	return q;
+}
+
+void
+edf_delete(struct edf_queue *q) {
+	free(q);
+}
+
+int
+edf_push(struct edf_queue *q, uint64_t deadline, int id) {
+	if (q->n >= q->size)
+		return 1;
+	int i = q->n++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (q->heap[parent].deadline <= deadline)
+			break;
+		q->heap[i] = q->heap[parent];
+		i = parent;
+	}
+	q->heap[i].deadline = deadline;
+	q->heap[i].id = id;
+	return 0;
+}
+
+int
+edf_pop(struct edf_queue *q) {
+	if (q->n == 0)
+		return 0;
+	int id = q->heap[0].id;
+	struct edf_node last = q->heap[--q->n];
+	int i = 0;
+	for (;;) {
+		int child = i * 2 + 1;
+		if (child >= q->n)
+			break;
+		if (child + 1 < q->n && q->heap[child + 1].deadline < q->heap[child].deadline)
+			++child;
+		if (last.deadline <= q->heap[child].deadline)
+			break;
+		q->heap[i] = q->heap[child];
+		i = child;
+	}
+	q->heap[i] = last;
+	return id;
+}
+
+int
+edf_size(struct edf_queue *q) {
+	return q->n;
+}
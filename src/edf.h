@@ -0,0 +1,18 @@
+#ifndef ltask_edf_h
+#define ltask_edf_h
+
+#include <stdint.h>
+
+// Runnable services ordered by the earliest deadline, only the scheduler uses it.
+
+struct edf_queue;
+
+struct edf_queue * edf_new(int size);
+void edf_delete(struct edf_queue *q);
+// 0 succ
+int edf_push(struct edf_queue *q, uint64_t deadline, int id);
+// 0 : empty
+int edf_pop(struct edf_queue *q);
+int edf_size(struct edf_queue *q);
+
+#endif
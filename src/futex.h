@@ -0,0 +1,27 @@
+#ifndef ltask_futex_h
+#define ltask_futex_h
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__) && !defined(DISABLE_FUTEX)
+
+#define FUTEX_SUPPORT
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "atomic.h"
+
+// Sleep while *addr == val, may return spuriously
+static inline void
+futex_wait(atomic_int *addr, int val) {
+	syscall(SYS_futex, (int *)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void
+futex_wake(atomic_int *addr, int n) {
+	syscall(SYS_futex, (int *)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#endif
+
+#endif
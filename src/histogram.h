@@ -0,0 +1,102 @@
+#ifndef ltask_histogram_h
+#define ltask_histogram_h
+
+#include <stdint.h>
+
+#include "atomic.h"
+
+// Log-linear buckets (like HdrHistogram) : 8 sub-buckets in each power of 2, the error is less than 12.5%.
+// Lock free, any thread can record.
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_SIZE ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+struct histogram {
+	atomic_u64 count;
+	atomic_u64 max;
+	atomic_u64 bucket[HISTOGRAM_SIZE];
+};
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+static inline int
+histogram_log2(uint64_t v) {
+	unsigned long index;
+	_BitScanReverse64(&index, v);
+	return (int)index;
+}
+
+#else
+
+static inline int
+histogram_log2(uint64_t v) {
+	return 63 - __builtin_clzll(v);
+}
+
+#endif
+
+static inline void
+histogram_init(struct histogram *h) {
+	int i;
+	atomic_u64_init(&h->count, 0);
+	atomic_u64_init(&h->max, 0);
+	for (i=0;i<HISTOGRAM_SIZE;i++) {
+		atomic_u64_init(&h->bucket[i], 0);
+	}
+}
+
+static inline int
+histogram_index(uint64_t v) {
+	if (v < HISTOGRAM_SUB)
+		return (int)v;
+	int e = histogram_log2(v);
+	int sub = (int)(v >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1);
+	return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + sub;
+}
+
+// The highest value in the bucket
+static inline uint64_t
+histogram_value(int index) {
+	if (index < HISTOGRAM_SUB)
+		return index;
+	int e = index / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub = index % HISTOGRAM_SUB;
+	uint64_t width = (uint64_t)1 << (e - HISTOGRAM_SUB_BITS);
+	return (HISTOGRAM_SUB + sub) * width + width - 1;
+}
+
+static inline void
+histogram_record(struct histogram *h, uint64_t v) {
+	atomic_u64_add(&h->bucket[histogram_index(v)], 1);
+	atomic_u64_add(&h->count, 1);
+	uint64_t max = atomic_u64_load(&h->max);
+	while (v > max) {
+		if (atomic_u64_cas(&h->max, &max, v))
+			break;
+	}
+}
+
+// q in [0, 1]
+static inline uint64_t
+histogram_percentile(struct histogram *h, double q) {
+	uint64_t count = atomic_u64_load(&h->count);
+	uint64_t rank = (uint64_t)(q * count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	uint64_t n = 0;
+	int i;
+	for (i=0;i<HISTOGRAM_SIZE;i++) {
+		n += atomic_u64_load(&h->bucket[i]);
+		if (n >= rank) {
+			uint64_t v = histogram_value(i);
+			uint64_t max = atomic_u64_load(&h->max);
+			return v < max ? v : max;
+		}
+	}
+	return atomic_u64_load(&h->max);
+}
+
+#endif
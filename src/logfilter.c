@@ -0,0 +1,159 @@
+#include "logfilter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOGFILTER_SITES 16
+#define TOKEN_UNIT 100	// tokens are refilled every centisecond
+
+struct bucket {
+	uint64_t last;
+	int64_t tokens;
+};
+
+struct site {
+	const void *source;
+	int line;
+	struct bucket b;
+};
+
+struct slot {
+	unsigned int id;
+	unsigned int sampled;
+	int dropped;
+	uint64_t report;
+	struct bucket b;
+	struct site *sites;	// LOGFILTER_SITES, created on demand
+};
+
+struct logfilter {
+	struct logfilter_config c;
+	int mask;
+	struct slot s[1];
+};
+
+struct logfilter *
+logfilter_new(const struct logfilter_config *c, int max_service) {
+	if (c->rate <= 0 && c->site_rate <= 0)
+		return NULL;
+	size_t sz = sizeof(struct logfilter) + (max_service - 1) * sizeof(struct slot);
+	struct logfilter *f = (struct logfilter *)malloc(sz);
+	if (f == NULL)
+		return NULL;
+	memset(f, 0, sz);
+	f->c = *c;
+	if (f->c.summary <= 0)
+		f->c.summary = 1;
+	f->mask = max_service - 1;
+	return f;
+}
+
+void
+logfilter_delete(struct logfilter *f) {
+	if (f == NULL)
+		return;
+	int i;
+	for (i=0;i<=f->mask;i++) {
+		free(f->s[i].sites);
+	}
+	free(f);
+}
+
+int
+logfilter_site(struct logfilter *f) {
+	return f->c.site_rate > 0;
+}
+
+static void
+bucket_init(struct bucket *b, int rate, uint64_t now) {
+	b->last = now;
+	b->tokens = (int64_t)rate * TOKEN_UNIT;
+}
+
+// 0 : take a token
+static int
+bucket_take(struct bucket *b, int rate, uint64_t now) {
+	if (rate <= 0)
+		return 0;
+	int64_t cap = (int64_t)rate * TOKEN_UNIT;
+	if (now > b->last) {
+		// refill rate tokens per second, burst is one second
+		b->tokens += (int64_t)(now - b->last) * rate;
+		if (b->tokens > cap)
+			b->tokens = cap;
+		b->last = now;
+	}
+	if (b->tokens < TOKEN_UNIT)
+		return 1;
+	b->tokens -= TOKEN_UNIT;
+	return 0;
+}
+
+static struct slot *
+get_slot(struct logfilter *f, service_id id, uint64_t now) {
+	struct slot *s = &f->s[id.id & f->mask];
+	if (s->id != id.id) {
+		// a new service reuses the slot
+		s->id = id.id;
+		s->sampled = 0;
+		s->dropped = 0;
+		s->report = now;
+		bucket_init(&s->b, f->c.rate, now);
+		if (s->sites)
+			memset(s->sites, 0, LOGFILTER_SITES * sizeof(struct site));
+	}
+	return s;
+}
+
+static struct site *
+get_site(struct logfilter *f, struct slot *s, const void *source, int line, uint64_t now) {
+	if (s->sites == NULL) {
+		s->sites = (struct site *)malloc(LOGFILTER_SITES * sizeof(struct site));
+		if (s->sites == NULL)
+			return NULL;
+		memset(s->sites, 0, LOGFILTER_SITES * sizeof(struct site));
+	}
+	uintptr_t h = (uintptr_t)source ^ ((uintptr_t)line * 0x9e3779b1u);
+	struct site *t = &s->sites[(h ^ (h >> 7)) % LOGFILTER_SITES];
+	if (t->source != source || t->line != line) {
+		// evict the other site in the same slot
+		t->source = source;
+		t->line = line;
+		bucket_init(&t->b, f->c.site_rate, now);
+	}
+	return t;
+}
+
+int
+logfilter_check(struct logfilter *f, service_id id, const void *site, int line, uint64_t now) {
+	struct slot *s = get_slot(f, id, now);
+	int drop = 0;
+	if (site && f->c.site_rate > 0) {
+		struct site *t = get_site(f, s, site, line, now);
+		if (t && bucket_take(&t->b, f->c.site_rate, now))
+			drop = 1;
+	}
+	if (!drop && bucket_take(&s->b, f->c.rate, now))
+		drop = 1;
+	if (drop) {
+		if (f->c.sample > 0 && ++s->sampled >= (unsigned int)f->c.sample) {
+			// let a sample through
+			s->sampled = 0;
+			return 0;
+		}
+		++s->dropped;
+		return 1;
+	}
+	return 0;
+}
+
+int
+logfilter_dropped(struct logfilter *f, service_id id, uint64_t now) {
+	struct slot *s = get_slot(f, id, now);
+	if (s->dropped == 0 || now < s->report + (uint64_t)f->c.summary * 100)
+		return 0;
+	int n = s->dropped;
+	s->dropped = 0;
+	s->report = now;
+	return n;
+}
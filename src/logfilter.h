@@ -0,0 +1,29 @@
+#ifndef ltask_logfilter_h
+#define ltask_logfilter_h
+
+#include <stdint.h>
+#include "service.h"
+
+// Rate limits of logs, per service and per call site of a service.
+// A slot belongs to one service, only the thread running the service touches it.
+
+struct logfilter;
+
+struct logfilter_config {
+	int rate;	// logs per second of a service, 0 : unlimited
+	int site_rate;	// logs per second of a call site, 0 : unlimited
+	int sample;	// keep one of every sample logs over the limit, 0 : drop all
+	int summary;	// seconds between dropped summaries
+};
+
+// NULL if no limit
+struct logfilter * logfilter_new(const struct logfilter_config *c, int max_service);
+void logfilter_delete(struct logfilter *f);
+// site_rate > 0 : needs the call site
+int logfilter_site(struct logfilter *f);
+// now in centisecond, site may be NULL. 0 : pass, 1 : drop
+int logfilter_check(struct logfilter *f, service_id id, const void *site, int line, uint64_t now);
+// returns the dropped count when the summary is due, and resets it
+int logfilter_dropped(struct logfilter *f, service_id id, uint64_t now);
+
+#endif
@@ -1,39 +1,137 @@
 #include "logqueue.h"
 #include "spinlock.h"
+#include "atomic.h"
 #include <stdlib.h>
 
-struct log_item {
-	struct log_item *next;
-	struct logmessage msg;
+#define LOGQUEUE_RING 1024
+
+// growable, protected by lock
+struct log_shared {
+	struct spinlock lock;
+	atomic_int n;
+	unsigned int head;
+	unsigned int cap;
+	struct logmessage *slot;
+};
+
+// single producer, single consumer.
+// When the ring is full, the producer pushes to overflow until the consumer drains it, so the order is kept.
+struct log_ring {
+	atomic_int head;
+	atomic_int tail;
+	struct log_shared overflow;
+	struct logmessage slot[LOGQUEUE_RING];
+};
+
+// a contiguous run of messages taken from one source by logqueue_popn
+struct log_run {
+	int pos;
+	int end;
 };
 
 struct logqueue {
-	struct log_item *freelist;
-	struct log_item *head;
-	struct log_item *tail;
-	struct spinlock lock;
+	int rings;
+	int next;	// the source taken first by logqueue_popn, rotates for fairness
+	struct spinlock consumer;
+	struct log_shared shared;
+	struct log_run *run;	// rings + 1 (the shared queue)
+	struct logmessage *batch;	// LOGQUEUE_BATCH
+	struct log_ring r[1];
 };
 
+static int
+shared_init(struct log_shared *s) {
+	if (spinlock_init(&s->lock))
+		return 1;
+	atomic_int_init(&s->n, 0);
+	s->head = 0;
+	s->cap = 0;
+	s->slot = NULL;
+	return 0;
+}
+
+static void
+shared_destroy(struct log_shared *s) {
+	spinlock_destroy(&s->lock);
+	free(s->slot);
+}
+
+// 0 : succ
+static int
+shared_push(struct log_shared *s, struct logmessage *m) {
+	spinlock_acquire(&s->lock);
+	unsigned int n = (unsigned int)atomic_int_load(&s->n);
+	if (n >= s->cap) {
+		unsigned int cap = s->cap ? s->cap * 2 : LOGQUEUE_RING;
+		struct logmessage *slot = (struct logmessage *)malloc(cap * sizeof(*slot));
+		if (slot == NULL) {
+			spinlock_release(&s->lock);
+			return 1;
+		}
+		unsigned int i;
+		for (i=0;i<n;i++) {
+			slot[i] = s->slot[(s->head + i) % s->cap];
+		}
+		free(s->slot);
+		s->slot = slot;
+		s->head = 0;
+		s->cap = cap;
+	}
+	s->slot[(s->head + n) % s->cap] = *m;
+	atomic_int_store(&s->n, (int)(n + 1));
+	spinlock_release(&s->lock);
+	return 0;
+}
+
+// call with lock
+static inline struct logmessage *
+shared_front(struct log_shared *s) {
+	if (atomic_int_load(&s->n) == 0)
+		return NULL;
+	return &s->slot[s->head];
+}
+
+// call with lock
+static inline void
+shared_pop(struct log_shared *s) {
+	s->head = (s->head + 1) % s->cap;
+	atomic_int_dec(&s->n);
+}
+
 struct logqueue *
-logqueue_new() {
-	struct logqueue *q = (struct logqueue *)malloc(sizeof(*q));
-	if (spinlock_init(&q->lock)) {
+logqueue_new(int rings) {
+	struct logqueue *q = (struct logqueue *)malloc(sizeof(*q) + (rings - 1) * sizeof(struct log_ring));
+	if (q == NULL)
+		return NULL;
+	q->rings = 0;
+	q->next = 0;
+	q->run = (struct log_run *)malloc((rings + 1) * sizeof(struct log_run));
+	q->batch = (struct logmessage *)malloc(LOGQUEUE_BATCH * sizeof(struct logmessage));
+	if (q->run == NULL || q->batch == NULL || spinlock_init(&q->consumer)) {
+		free(q->run);
+		free(q->batch);
 		free(q);
 		return NULL;
 	}
-	q->freelist = NULL;
-	q->head = NULL;
-	q->tail = NULL;
-	return q;
-}
-
-static void
-free_items(struct log_item *item) {
-	while (item) {
-		struct log_item *temp = item;
-		item = item->next;
-		free(temp);
+	if (shared_init(&q->shared)) {
+		spinlock_destroy(&q->consumer);
+		free(q->run);
+		free(q->batch);
+		free(q);
+		return NULL;
 	}
+	int i;
+	for (i=0;i<rings;i++) {
+		struct log_ring *r = &q->r[i];
+		atomic_int_init(&r->head, 0);
+		atomic_int_init(&r->tail, 0);
+		if (shared_init(&r->overflow)) {
+			logqueue_delete(q);
+			return NULL;
+		}
+		q->rings = i + 1;
+	}
+	return q;
 }
 
 void
@@ -42,58 +140,164 @@ logqueue_delete(struct logqueue *q) {
 	while (!logqueue_pop(q, &m)) {
 		free(m.msg);
 	}
-	spinlock_destroy(&q->lock);
-	free_items(q->freelist);
+	int i;
+	for (i=0;i<q->rings;i++) {
+		shared_destroy(&q->r[i].overflow);
+	}
+	shared_destroy(&q->shared);
+	spinlock_destroy(&q->consumer);
+	free(q->run);
+	free(q->batch);
 	free(q);
 }
 
-static inline struct log_item *
-alloc_item(struct logqueue *q) {
-	struct log_item * ret = q->freelist;
-	if (ret == NULL) {
-		ret = (struct log_item *)malloc(sizeof(*ret));
-	} else {
-		q->freelist = ret->next;
+int
+logqueue_push(struct logqueue *q, int ring, struct logmessage *m) {
+	if (ring < 0 || ring >= q->rings)
+		return shared_push(&q->shared, m);
+	struct log_ring *r = &q->r[ring];
+	if (atomic_int_load(&r->overflow.n) == 0) {
+		// indexes wrap around as unsigned
+		unsigned int tail = (unsigned int)atomic_int_load(&r->tail);
+		if (tail - (unsigned int)atomic_int_load(&r->head) < LOGQUEUE_RING) {
+			r->slot[tail % LOGQUEUE_RING] = *m;
+			atomic_int_store(&r->tail, (int)(tail + 1));
+			return 0;
+		}
 	}
-	return ret;
+	return shared_push(&r->overflow, m);
 }
 
-int
-logqueue_push(struct logqueue *q, struct logmessage *m) {
-	spinlock_acquire(&q->lock);
-	struct log_item *item = alloc_item(q);
-	if (item == NULL) {
-		spinlock_release(&q->lock);
+// copy the earliest message of the ring, 0 : empty
+static int
+ring_front(struct log_ring *r, struct logmessage *m) {
+	unsigned int head = (unsigned int)atomic_int_load(&r->head);
+	if (head != (unsigned int)atomic_int_load(&r->tail)) {
+		*m = r->slot[head % LOGQUEUE_RING];
 		return 1;
 	}
-	if (q->head == NULL) {
-		q->head = q->tail = item;
-		item->next = NULL;
+	if (atomic_int_load(&r->overflow.n) == 0)
+		return 0;
+	// overflow may grow (realloc) by the producer, so copy it with lock
+	spinlock_acquire(&r->overflow.lock);
+	*m = *shared_front(&r->overflow);
+	spinlock_release(&r->overflow.lock);
+	return 1;
+}
+
+static void
+ring_pop(struct log_ring *r) {
+	unsigned int head = (unsigned int)atomic_int_load(&r->head);
+	if (head != (unsigned int)atomic_int_load(&r->tail)) {
+		atomic_int_store(&r->head, (int)(head + 1));
 	} else {
-		q->tail->next = item;
-		item->next = NULL;
-		q->tail = item;
+		spinlock_acquire(&r->overflow.lock);
+		shared_pop(&r->overflow);
+		spinlock_release(&r->overflow.lock);
 	}
-	item->msg = *m;
-	spinlock_release(&q->lock);
-	return 0;
 }
 
 int
 logqueue_pop(struct logqueue *q, struct logmessage *m) {
-	spinlock_acquire(&q->lock);
-	if (q->head == NULL) {
-		spinlock_release(&q->lock);
-		return 1;
+	spinlock_acquire(&q->consumer);
+	struct log_ring *from = NULL;
+	struct logmessage earliest;
+	int i;
+	for (i=0;i<q->rings;i++) {
+		struct log_ring *r = &q->r[i];
+		struct logmessage msg;
+		if (ring_front(r, &msg) && (from == NULL || msg.timestamp < earliest.timestamp)) {
+			earliest = msg;
+			from = r;
+		}
 	}
-	struct log_item * ret = q->head;
-	q->head = ret->next;
-	if (q->head == NULL) {
-		q->tail = NULL;
+	struct log_shared *s = &q->shared;
+	spinlock_acquire(&s->lock);
+	const struct logmessage *msg = shared_front(s);
+	if (msg && (from == NULL || msg->timestamp < earliest.timestamp)) {
+		*m = *msg;
+		shared_pop(s);
+		spinlock_release(&s->lock);
+		spinlock_release(&q->consumer);
+		return 0;
 	}
-	ret->next = q->freelist;
-	q->freelist = ret;
-	*m = ret->msg;
-	spinlock_release(&q->lock);
+	spinlock_release(&s->lock);
+	if (from == NULL) {
+		spinlock_release(&q->consumer);
+		return 1;
+	}
+	*m = earliest;
+	ring_pop(from);
+	spinlock_release(&q->consumer);
 	return 0;
 }
+
+// call with lock, returns the number of messages taken
+static int
+shared_take(struct log_shared *s, struct logmessage *m, int n) {
+	int c = 0;
+	const struct logmessage *msg;
+	while (c < n && (msg = shared_front(s))) {
+		m[c++] = *msg;
+		shared_pop(s);
+	}
+	return c;
+}
+
+// take the ready messages of the ring in order, returns the number
+static int
+ring_take(struct log_ring *r, struct logmessage *m, int n) {
+	unsigned int head = (unsigned int)atomic_int_load(&r->head);
+	unsigned int tail = (unsigned int)atomic_int_load(&r->tail);
+	int c = 0;
+	while (head != tail && c < n) {
+		m[c++] = r->slot[head % LOGQUEUE_RING];
+		++head;
+	}
+	atomic_int_store(&r->head, (int)head);
+	// the messages in overflow are later than the ones in the ring, see logqueue_push
+	if (c < n && head == (unsigned int)atomic_int_load(&r->tail) && atomic_int_load(&r->overflow.n) > 0) {
+		spinlock_acquire(&r->overflow.lock);
+		c += shared_take(&r->overflow, m + c, n - c);
+		spinlock_release(&r->overflow.lock);
+	}
+	return c;
+}
+
+int
+logqueue_popn(struct logqueue *q, struct logmessage *m, int n) {
+	if (n > LOGQUEUE_BATCH)
+		n = LOGQUEUE_BATCH;
+	spinlock_acquire(&q->consumer);
+	int sources = q->rings + 1;
+	int c = 0;
+	int i;
+	for (i=0;i<sources;i++) {
+		int idx = (q->next + i) % sources;
+		struct log_run *run = &q->run[idx];
+		run->pos = c;
+		if (idx < q->rings) {
+			c += ring_take(&q->r[idx], q->batch + c, n - c);
+		} else if (c < n && atomic_int_load(&q->shared.n) > 0) {
+			spinlock_acquire(&q->shared.lock);
+			c += shared_take(&q->shared, q->batch + c, n - c);
+			spinlock_release(&q->shared.lock);
+		}
+		run->end = c;
+	}
+	// the source taken first may fill the batch, so start from the next one next time
+	q->next = (q->next + 1) % sources;
+	// each run is in order, merge them by timestamp
+	for (i=0;i<c;i++) {
+		struct log_run *from = NULL;
+		int j;
+		for (j=0;j<sources;j++) {
+			struct log_run *run = &q->run[j];
+			if (run->pos < run->end && (from == NULL || q->batch[run->pos].timestamp < q->batch[from->pos].timestamp))
+				from = run;
+		}
+		m[i] = q->batch[from->pos++];
+	}
+	spinlock_release(&q->consumer);
+	return c;
+}
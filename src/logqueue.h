@@ -14,10 +14,17 @@ struct logmessage {
 	void *msg;
 };
 
-struct logqueue * logqueue_new();
+// A single-producer ring for each worker, and a shared queue with lock for the others
+struct logqueue * logqueue_new(int rings);
 void logqueue_delete(struct logqueue *);
-// 0 : succ
-int logqueue_push(struct logqueue *q, struct logmessage *m);
+// ring < 0 : the shared queue. 0 : succ
+int logqueue_push(struct logqueue *q, int ring, struct logmessage *m);
+#define LOGQUEUE_BATCH 256
+
+// pop the earliest message of all rings
 int logqueue_pop(struct logqueue *q, struct logmessage *m);
+// pop at most n (LOGQUEUE_BATCH) messages, taking each ring and the shared queue once, sorted by timestamp.
+// returns the number of messages
+int logqueue_popn(struct logqueue *q, struct logmessage *m, int n);
 
 #endif
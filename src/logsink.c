@@ -0,0 +1,235 @@
+#include "logsink.h"
+#include "logqueue.h"
+#include "lua-seri.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOGSINK_BUFFER (64 * 1024)
+#define LOGSINK_BACKUP 5
+#define LOGSINK_FILENAME 128
+
+struct logsink {
+	lua_State *L;	// unpack and format the messages
+	FILE *f;
+	size_t rotate;
+	size_t size;	// size of current file
+	size_t n;	// bytes in buffer
+	time_t prefix_sec;
+	char prefix[32];	// cached "YYYY-mm-dd HH:MM:SS" of prefix_sec
+	char filename[LOGSINK_FILENAME];
+	char buffer[LOGSINK_BUFFER];
+};
+
+static int
+open_file(struct logsink *s) {
+	s->f = fopen(s->filename, "ab");
+	if (s->f == NULL)
+		return 1;
+	fseek(s->f, 0, SEEK_END);
+	long sz = ftell(s->f);
+	s->size = sz > 0 ? (size_t)sz : 0;
+	return 0;
+}
+
+struct logsink *
+logsink_new(const char *filename, size_t rotate) {
+	size_t sz = strlen(filename);
+	if (sz >= LOGSINK_FILENAME)
+		return NULL;
+	struct logsink *s = (struct logsink *)malloc(sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	memcpy(s->filename, filename, sz + 1);
+	s->rotate = rotate;
+	s->n = 0;
+	s->prefix_sec = (time_t)-1;
+	s->prefix[0] = 0;
+	if (open_file(s)) {
+		free(s);
+		return NULL;
+	}
+	s->L = luaL_newstate();
+	if (s->L == NULL) {
+		fclose(s->f);
+		free(s);
+		return NULL;
+	}
+	luaL_requiref(s->L, LUA_STRLIBNAME, luaopen_string, 1);
+	lua_pop(s->L, 1);
+	return s;
+}
+
+static void
+write_buffer(struct logsink *s) {
+	if (s->n == 0)
+		return;
+	fwrite(s->buffer, 1, s->n, s->f);
+	s->size += s->n;
+	s->n = 0;
+}
+
+// filename -> filename.1 -> ... -> filename.LOGSINK_BACKUP
+static void
+rotate_file(struct logsink *s) {
+	fclose(s->f);
+	char from[LOGSINK_FILENAME + 8];
+	char to[LOGSINK_FILENAME + 8];
+	int i;
+	for (i=LOGSINK_BACKUP-1;i>0;i--) {
+		snprintf(from, sizeof(from), "%s.%d", s->filename, i);
+		snprintf(to, sizeof(to), "%s.%d", s->filename, i+1);
+		remove(to);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", s->filename);
+	remove(to);
+	rename(s->filename, to);
+	if (open_file(s)) {
+		// can't reopen, keep logs on stderr
+		s->f = stderr;
+		s->rotate = 0;
+	}
+}
+
+void
+logsink_flush(struct logsink *s) {
+	write_buffer(s);
+	fflush(s->f);
+	if (s->rotate && s->size >= s->rotate)
+		rotate_file(s);
+}
+
+void
+logsink_delete(struct logsink *s) {
+	if (s == NULL)
+		return;
+	write_buffer(s);
+	if (s->f != stderr)
+		fclose(s->f);
+	lua_close(s->L);
+	free(s);
+}
+
+static void
+append(struct logsink *s, const char *str, size_t sz) {
+	while (sz > 0) {
+		size_t n = LOGSINK_BUFFER - s->n;
+		if (n == 0) {
+			write_buffer(s);
+			n = LOGSINK_BUFFER;
+		}
+		if (n > sz)
+			n = sz;
+		memcpy(s->buffer + s->n, str, n);
+		s->n += n;
+		str += n;
+		sz -= n;
+	}
+}
+
+static const char *
+time_prefix(struct logsink *s, time_t sec) {
+	if (sec != s->prefix_sec) {
+		struct tm tm;
+#if defined(_WIN32)
+		localtime_s(&tm, &sec);
+#else
+		localtime_r(&sec, &tm);
+#endif
+		strftime(s->prefix, sizeof(s->prefix), "%Y-%m-%d %H:%M:%S", &tm);
+		s->prefix_sec = sec;
+	}
+	return s->prefix;
+}
+
+/*
+	lightuserdata message
+	return level, message
+	message is packed as (level, fmt, label, ...) by ltask.log, or (level, message)
+ */
+static int
+lformat(lua_State *L) {
+	lua_settop(L, 1);
+	int n = luaseri_unpack_remove(L);
+	if (n < 2) {
+		lua_pushstring(L, "?");
+		lua_pushstring(L, "Invalid log message");
+		return 2;
+	}
+	if (n == 2) {
+		lua_pushvalue(L, 2);
+		luaL_tolstring(L, 3, NULL);
+		return 2;
+	}
+	const int fmt = 3;
+	const int label = 4;
+	const int top = n + 1;
+	if (lua_type(L, fmt) == LUA_TSTRING) {
+		lua_getglobal(L, LUA_STRLIBNAME);
+		lua_getfield(L, -1, "format");
+		lua_pushvalue(L, fmt);
+		int i;
+		for (i=label+1;i<=top;i++) {
+			lua_pushvalue(L, i);
+		}
+		if (lua_pcall(L, top - label + 1, 1, 0) != LUA_OK) {
+			lua_pushfstring(L, "%s (%s)", lua_tostring(L, fmt), lua_tostring(L, -1));
+		}
+	} else {
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		int i;
+		for (i=label+1;i<=top;i++) {
+			if (i > label+1)
+				luaL_addchar(&b, '\t');
+			luaL_tolstring(L, i, NULL);
+			luaL_addvalue(&b);
+		}
+		luaL_pushresult(&b);
+	}
+	const char *message = lua_tostring(L, -1);
+	const char *name = luaL_tolstring(L, label, NULL);
+	lua_pushvalue(L, 2);
+	lua_pushfstring(L, "( %s ) %s", name, message);
+	return 2;
+}
+
+void
+logsink_write(struct logsink *s, uint64_t timestamp, struct logmessage *m) {
+	lua_State *L = s->L;
+	lua_settop(L, 0);
+	lua_pushcfunction(L, lformat);
+	lua_pushlightuserdata(L, m->msg);
+	const char *level = "?";
+	const char *message;
+	if (lua_pcall(L, 1, 2, 0) != LUA_OK) {
+		message = lua_tostring(L, -1);
+	} else {
+		level = lua_tostring(L, -2);
+		message = lua_tostring(L, -1);
+	}
+	if (level == NULL)
+		level = "?";
+	if (message == NULL)
+		message = "";
+	char head[64];
+	char upper[8];
+	size_t i;
+	for (i=0;i<sizeof(upper)-1 && level[i];i++) {
+		char c = level[i];
+		upper[i] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+	}
+	upper[i] = 0;
+	int n = snprintf(head, sizeof(head), "[%s.%02d][%-5s]", time_prefix(s, (time_t)(timestamp / 100)), (int)(timestamp % 100), upper);
+	append(s, head, n);
+	append(s, message, strlen(message));
+	append(s, "\n", 1);
+	lua_settop(L, 0);
+}
@@ -0,0 +1,17 @@
+#ifndef ltask_logsink_h
+#define ltask_logsink_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct logsink;
+struct logmessage;
+
+// rotate : rotate the file when it's larger than rotate bytes, 0 : never
+struct logsink * logsink_new(const char *filename, size_t rotate);
+void logsink_delete(struct logsink *s);
+// timestamp in centisecond since epoch, the message is freed
+void logsink_write(struct logsink *s, uint64_t timestamp, struct logmessage *m);
+void logsink_flush(struct logsink *s);
+
+#endif
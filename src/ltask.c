@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 
 #include "atomic.h"
@@ -27,6 +28,14 @@
 #include "systime.h"
 #include "threadsig.h"
 #include "semaphore.h"
+#include "commgraph.h"
+#include "sysinfo.h"
+#include "edf.h"
+#include "histogram.h"
+#include "trace.h"
+#include "profile.h"
+#include "logsink.h"
+#include "logfilter.h"
 
 LUAMOD_API int luaopen_ltask(lua_State *L);
 LUAMOD_API int luaopen_ltask_bootstrap(lua_State *L);
@@ -35,6 +44,8 @@ LUAMOD_API int luaopen_ltask_root(lua_State *L);
 #define THREAD_NONE -1
 #define THREAD_MAINTHREAD -2
 #define THREAD_WORKER(n) (n)
+#define THREAD_RESIZE -3
+#define THREAD_METRICS -4
 
 #ifndef DEBUGLOG
 
@@ -86,24 +97,58 @@ mainthread_trigger(struct mainthread_session *mt) {
 	sem_post(&mt->ev);
 }
 
+struct timer_event {
+	session_t session;
+	service_id id;
+};
+
+struct timer_blocked {
+	unsigned int id;
+	unsigned int gen;	// the slot is empty if gen is not the current one
+};
+
+// Expired timers, blocked ones are kept at the front
+struct timer_expired {
+	int n;
+	int cap;
+	unsigned int gen;	// of dispatch_timer
+	struct timer_event *e;
+	struct timer_blocked *blocked;	// hash set of the blocked services, cap * 2 slots
+};
+
 struct ltask {
 	const struct ltask_config *config;
 	struct worker_thread *workers;
+	struct worker_state state;
 	atomic_int event_init[MAX_SOCKEVENT];
 	struct sockevent event[MAX_SOCKEVENT];
 	struct service_pool *services;
 	struct queue *schedule;
+	struct queue *group_pending[MAX_GROUP];	// services wait for a free worker of the group, NULL without groups
 	struct timer *timer;
+	struct timer_expired expired;	// only the scheduler owner touches it
+	struct commgraph *graph;
+	struct logfilter *logfilter;	// rate limits of ltask.pushlog, NULL : unlimited
+	struct edf_queue *edf;
+	int edf_burst;	// deadline services taken in a row, see prepare_task
+	struct histogram *latency_queue;	// from runnable to resume
+	struct histogram *latency_dispatch;	// schedule_dispatch
+	struct trace *trace;
 #ifdef DEBUGLOG
 	struct debug_logger *logger;
 #endif
 	struct logqueue *lqueue;
+	struct logsink *sink;	// config.logfile, drained by thread_logsink
 	struct queue *external_message;
 	struct message *external_last_message;
 	struct mainthread_session mt;
+	struct worker_metrics mt_metrics;
 	atomic_int schedule_owner;
 	atomic_int active_worker;
 	atomic_int thread_count;
+	atomic_int deadline_miss;
+	int worker_n;			// active workers, changed by worker_resize
+	int main_worker;		// the worker runs in main thread, -1 : none
 	int blocked_service;		// binding service may block
 	FILE *logfile;
 	int exit_code;			// process exit code, set by root service
@@ -116,18 +161,41 @@ struct service_ud {
 
 static int
 get_worker_id(struct ltask *task, service_id id) {
-	int total_worker = task->config->worker;
-	int i;
-	for (i=0;i<total_worker;i++) {
-		struct worker_thread * w = &task->workers[i];
-		if (w->running.id == id.id)
-			return i;
-	}
+	int worker = service_worker_get(task->services, id);
+	if (worker >= 0 && task->workers[worker].running.id == id.id)
+		return worker;
 	return -1;
 }
 
+// ring of worker, the last ring is for mainthread
+static inline void
+trace_event(struct ltask *task, int worker, int type, unsigned int id, unsigned int arg) {
+	if (task->trace) {
+		if (worker < 0)
+			worker = task->config->worker_max;
+		trace_record(task->trace, worker, type, id, arg);
+	}
+}
+
+// 1 : the worker can run the service of the group
+static inline int
+worker_eligible(struct ltask *task, int worker, int group) {
+	const struct ltask_config *config = task->config;
+	if (config->group_n <= 1)
+		return 1;
+	int g = config->worker_group[worker];
+	return g == group || config->group[g].steal;
+}
+
 static inline void
 schedule_back(struct ltask *task, service_id id) {
+	if (task->latency_queue)
+		service_runnable(task->services, id);
+	if (task->edf) {
+		uint64_t deadline = service_deadline_get(task->services, id);
+		if (deadline && edf_push(task->edf, deadline, (int)id.id) == 0)
+			return;
+	}
 	int r = queue_push_int(task->schedule, (int)id.id);
 	// Must succ because task->schedule is large enough.
 	(void)r;
@@ -190,6 +258,10 @@ dispatch_out_message(struct ltask *task, service_id id, struct message *msg) {
 	if (msg->to.id == SERVICE_ID_SYSTEM) {
 		dispatch_schedule_message(task, id, msg);
 	} else {
+		if (task->graph) {
+			commgraph_add(task->graph, id, msg->to);
+		}
+		trace_event(task, atomic_int_load(&task->schedule_owner), TRACE_SEND, id.id, msg->to.id);
 		switch (service_push_message(P, msg->to, msg)) {
 		case 0 :
 			// succ
@@ -210,8 +282,9 @@ static int
 collect_done_job(struct ltask *task, service_id done_job[]) {
 	int done_job_n = 0;
 	int i;
-	const int worker_n = task->config->worker;
-	for (i=0;i<worker_n;i++) {
+	const int worker_n = task->config->worker_max;	// retired workers may finish their jobs
+	struct bitmap *done = &task->state.done;
+	for (i=bitmap_next(done, 0, worker_n);i>=0;i=bitmap_next(done, i+1, worker_n)) {
 		struct worker_thread * w = &task->workers[i];
 		service_id job = worker_done_job(w);
 		if (job.id) {
@@ -265,6 +338,8 @@ dispatch_out_messages(struct ltask *task, const service_id done_job[], int done_
 					msg.type = MESSAGE_IDLE;
 					msg.msg = NULL;
 					msg.sz = 0;
+					msg.trace = 0;
+					msg.span = 0;
 					service_push_message(P, id, message_new(&msg));
 					service_status_set(P, id, SERVICE_STATUS_SCHEDULE);
 					schedule_back(task, id);
@@ -285,52 +360,97 @@ static inline void
 kick_running(struct worker_thread * w, service_id id) {
 	w->task->blocked_service = 1;
 	w->waiting = id;	// will kick running later
+	bitmap_set(&w->state->waiting, w->worker_id);
 }
 
 static int
 count_freeslot(struct ltask *task) {
 	int i;
-	int free_slot = 0;
-	const int worker_n = task->config->worker;
-	for (i=0;i<worker_n;i++) {
+	const int worker_n = task->worker_n;
+	struct worker_state *S = &task->state;
+	// only the scheduler sets service_ready, so a clear bit means a free slot
+	for (i=bitmap_next(&S->ready, 0, worker_n);i>=0;i=bitmap_next(&S->ready, i+1, worker_n)) {
+		if (!worker_has_job(&task->workers[i]))
+			bitmap_clear(&S->ready, i);
+	}
+	for (i=bitmap_next(&S->queued, 0, worker_n);i>=0;i=bitmap_next(&S->queued, i+1, worker_n)) {
 		struct worker_thread * w = &task->workers[i];
-		if (w->service_ready == 0) {
+		if (!bitmap_test(&S->ready, i)) {
 			struct binding_service * q = &(w->binding_queue);
-			if (q->tail == q->head) {
-				if (!worker_has_job(w)) {
-					++free_slot;
-				}
-			} else {
-				service_id id = q->q[q->head % BINDING_SERVICE_QUEUE];
-				++q->head;
-				if (q->head == q->tail)
-					q->head = q->tail = 0;
-				atomic_int_store(&w->service_ready, id.id);
-				kick_running(w, id);
-				worker_wakeup(w);
-				debug_printf(task->logger, "Assign queue %x to worker %d", id.id, i);
+			service_id id = binding_queue_pop(q);
+			if (binding_queue_empty(q)) {
+				bitmap_clear(&S->queued, i);
+			}
+			worker_set_job(w, id);
+			kick_running(w, id);
+			worker_wakeup(w);
+			debug_printf(task->logger, "Assign queue %x to worker %d", id.id, i);
+		}
+	}
+	return worker_n - bitmap_count(&S->ready, worker_n);
+}
+
+// the services parked by assign_prepare_task, retry them when there are free workers of their groups
+static int
+prepare_group_pending(struct ltask *task, service_id prepare[], int free_slot, int prepare_n) {
+	const int worker_n = task->worker_n;
+	// each free worker is reserved for one service only, even if it's eligible for several groups
+	struct bitmap free_worker;
+	bitmap_init(&free_worker);
+	int i;
+	for (i=0;i<worker_n;i++) {
+		if (!worker_has_job(&task->workers[i]))
+			bitmap_set(&free_worker, i);
+	}
+	int g;
+	for (g=0;g<task->config->group_n && free_slot > 0;g++) {
+		struct queue *q = task->group_pending[g];
+		if (q == NULL || queue_length(q) == 0)
+			continue;
+		for (i=bitmap_next(&free_worker, 0, worker_n);i>=0 && free_slot > 0;i=bitmap_next(&free_worker, i+1, worker_n)) {
+			if (worker_eligible(task, i, g)) {
+				service_id id = { queue_pop_int(q) };
+				if (id.id == 0)
+					break;
+				bitmap_clear(&free_worker, i);
+				prepare[prepare_n++] = id;
+				--free_slot;
 			}
 		}
 	}
-	return free_slot;
+	return prepare_n;
 }
 
 static int
 prepare_task(struct ltask *task, service_id prepare[], int free_slot, int prepare_n) {
 	int i;
 	for (i=0;i<free_slot;i++) {
-		int job = queue_pop_int(task->schedule);
+		int job = 0;
+		if (task->edf && (task->edf_burst < task->config->edf_burst || queue_length(task->schedule) == 0)) {
+			job = edf_pop(task->edf);
+			if (job)
+				++task->edf_burst;
+		}
+		if (job == 0) {
+			// a FIFO service after edf_burst deadline services at most
+			job = queue_pop_int(task->schedule);
+			task->edf_burst = 0;
+		}
 		if (job == 0)	// no more job
 			break;
 		service_id id = { job };
 		int worker = service_binding_get(task->services, id);
+		if (worker >= task->worker_n) {
+			// the worker is retired, keep the binding for the worker started again by worker_resize
+			worker = -1;
+		}
 		if (worker < 0) {
 			// no binding worker
 			prepare[prepare_n++] = id;
 		} else {
 			struct worker_thread * w = &task->workers[worker];
 			if (worker_binding_job(w, id)) {
-				// worker queue is full
+				// out of memory, try again later
 				queue_push_int(task->schedule, job);
 			} else {
 				id = worker_assign_job(w, id);
@@ -352,8 +472,9 @@ trigger_blocked_workers(struct ltask *task) {
 		return;
 	int i;
 	int blocked = 0;
-	const int worker_n = task->config->worker;
-	for (i=0;i<worker_n;i++) {
+	const int worker_n = task->config->worker_max;
+	struct bitmap *waiting = &task->state.waiting;
+	for (i=bitmap_next(waiting, 0, worker_n);i>=0;i=bitmap_next(waiting, i+1, worker_n)) {
 		struct worker_thread * w = &task->workers[i];
 		if (w->waiting.id != 0) {
 			service_id running = w->running;
@@ -364,38 +485,98 @@ trigger_blocked_workers(struct ltask *task) {
 					sockevent_trigger(&task->event[sockevent_id]);
 				}
 				w->waiting.id = 0;
+				bitmap_clear(waiting, i);
 			} else {
 				// continue waiting for blocked service running
 				blocked = 1;
 			}
+		} else {
+			bitmap_clear(waiting, i);
 		}
 	}
 	task->blocked_service = blocked;
 }
 
+// 1 : assign to the worker
+static int
+assign_worker(struct ltask *task, int worker, service_id id) {
+	if (worker < 0 || worker >= task->worker_n || !worker_eligible(task, worker, service_group_get(task->services, id)))
+		return 0;
+	struct worker_thread * w = &task->workers[worker];
+	if (w->busy || w->binding.id != 0)
+		return 0;
+	service_id assign = worker_assign_job(w, id);
+	if (assign.id == 0)
+		return 0;
+	worker_wakeup(w);
+	debug_printf(task->logger, "Assign %x to worker %d (affinity)", assign.id, worker);
+	// binding queue of the worker may be assigned instead
+	return assign.id == id.id;
+}
+
+// 1 : assign to an idle worker of the NUMA node
+static int
+assign_node(struct ltask *task, int node, service_id id) {
+	const int worker_n = task->worker_n;
+	int i;
+	for (i=0;i<worker_n;i++) {
+		struct worker_thread * w = &task->workers[i];
+		if (task->config->node[i] == node && !worker_has_job(w) && assign_worker(task, i, id))
+			return 1;
+	}
+	return 0;
+}
+
+// 1 : assign to the worker (or NUMA node) of the service it talks with, or the worker it ran last time
+static int
+assign_affinity(struct ltask *task, service_id id) {
+	struct service_pool *P = task->services;
+	if (task->graph) {
+		service_id peer = commgraph_peer(task->graph, id);
+		if (peer.id) {
+			int worker = service_worker_get(P, peer);
+			if (assign_worker(task, worker, id))
+				return 1;
+			if (worker >= 0 && task->config->pin && assign_node(task, task->config->node[worker], id))
+				return 1;
+		}
+	}
+	return assign_worker(task, service_worker_get(P, id), id);
+}
+
 static void
 assign_prepare_task(struct ltask *task, const service_id prepare[], int prepare_n) {
 	int i;
 	int worker_id = 0;
-	const int worker_n = task->config->worker;
+	const int worker_n = task->worker_n;
 	int use_busy = 0;
 	int use_binding = 0;
 
 	for (i=0;i<prepare_n;i++) {
 		service_id id = prepare[i];
+		if (assign_affinity(task, id))
+			continue;
+		int group = service_group_get(task->services, id);
 		for (;;) {
 			if (worker_id >= worker_n) {
 				if (use_busy == 0) {
 					use_busy = 1;
 					worker_id = 0;
-				} else {
-					assert(use_binding == 0);
+				} else if (use_binding == 0) {
 					use_binding = 1;
 					worker_id = 0;
+				} else {
+					// no free worker in the group, park it until one is free (see prepare_group_pending)
+					assert(task->config->group_n > 1);
+					debug_printf(task->logger, "No worker for %x in group %d", id.id, group);
+					if (task->group_pending[group] == NULL || queue_push_int(task->group_pending[group], id.id))
+						schedule_back(task, id);
+					worker_id = 0;
+					break;
 				}
 			}
 			struct worker_thread * w = &task->workers[worker_id++];
-			if ((use_busy || !w->busy) && (w->binding.id == 0 || use_binding)) {
+			if ((use_busy || !w->busy) && (w->binding.id == 0 || use_binding) && worker_eligible(task, worker_id-1, group)) {
 				service_id assign = worker_assign_job(w, id);
 				if (assign.id != 0) {
 					worker_wakeup(w);
@@ -413,10 +594,11 @@ assign_prepare_task(struct ltask *task, const service_id prepare[], int prepare_
 static int
 get_pending_jobs(struct ltask *task, service_id output[]) {
 	int i;
-	int worker_n = task->config->worker;
+	int worker_n = task->config->worker_max;
 	int n = 0;
 	struct service_pool * P = task->services;
-	for (i=0;i<worker_n;i++) {
+	struct bitmap *busy = &task->state.busy;
+	for (i=bitmap_next(busy, 0, worker_n);i>=0;i=bitmap_next(busy, i+1, worker_n)) {
 		struct worker_thread * w = &task->workers[i];
 		if (w->busy) {
 			service_id id = worker_steal_job(w, P);
@@ -459,6 +641,8 @@ dispatch_external_messages(struct ltask *task) {
 		m.session = (session_t)0;	// no response
 		m.type = MESSAGE_REQUEST;
 		m.msg = seri_packstring("external", 0, msg, &m.sz);
+		m.trace = 0;
+		m.span = 0;
 
 		struct message *em = message_new(&m);
 		if (send_external_message(task, em)) {
@@ -474,8 +658,106 @@ dispatch_external_messages(struct ltask *task) {
 	}
 }
 
+static int
+timer_expired_callback(void *ud, void *arg) {
+	struct timer_expired *E = (struct timer_expired *)ud;
+	if (E->n >= E->cap) {
+		int cap = E->cap ? E->cap * 2 : 256;
+		struct timer_blocked *b = (struct timer_blocked *)calloc(cap * 2, sizeof(*b));
+		if (b == NULL)
+			return 1;	// out of memory, the timer keeps it for the next tick
+		struct timer_event *e = (struct timer_event *)realloc(E->e, cap * sizeof(*e));
+		if (e == NULL) {
+			free(b);
+			return 1;
+		}
+		free(E->blocked);
+		E->blocked = b;
+		E->gen = 0;
+		E->e = e;
+		E->cap = cap;
+	}
+	E->e[E->n++] = *(const struct timer_event *)arg;
+	return 0;
+}
+
+// returns 1 if id is blocked in this dispatch, or mark it when block is set
+static int
+timer_blocked(struct timer_expired *E, service_id id, int block) {
+	unsigned int mask = (unsigned int)E->cap * 2 - 1;
+	unsigned int h = id.id & mask;
+	for (;;) {
+		struct timer_blocked *b = &E->blocked[h];
+		if (b->gen != E->gen) {
+			if (block) {
+				b->id = id.id;
+				b->gen = E->gen;
+			}
+			return 0;
+		}
+		if (b->id == id.id)
+			return 1;
+		h = (h + 1) & mask;
+	}
+}
+
+// Send the responses of expired timers to the services directly
+static void
+dispatch_timer(struct ltask *task) {
+	struct timer_expired *E = &task->expired;
+	timer_update(task->timer, timer_expired_callback, E);
+	if (E->n == 0)
+		return;
+	if (++E->gen == 0) {
+		memset(E->blocked, 0, E->cap * 2 * sizeof(struct timer_blocked));
+		E->gen = 1;
+	}
+	struct service_pool *P = task->services;
+	service_id last = { 0 };
+	int i;
+	int n = 0;
+	for (i=0;i<E->n;i++) {
+		struct timer_event ev = E->e[i];
+		if (n > 0 && timer_blocked(E, ev.id, 0)) {
+			// keep the order of the responses to a blocked service
+			E->e[n++] = ev;
+			continue;
+		}
+		struct message m;
+		m.from.id = SERVICE_ID_SYSTEM;
+		m.to = ev.id;
+		m.session = ev.session;
+		m.type = MESSAGE_RESPONSE;
+		m.msg = NULL;
+		m.sz = 0;
+		m.trace = 0;
+		m.span = 0;
+		struct message *msg = message_new(&m);
+		switch (service_push_message(P, ev.id, msg)) {
+		case 0 :
+			if (ev.id.id != last.id) {
+				check_message_to(task, ev.id);
+				last = ev.id;
+			}
+			break;
+		case 1 :
+			debug_printf(task->logger, "Service %x is blocked, timer session %d later", ev.id.id, ev.session);
+			message_delete(msg);
+			timer_blocked(E, ev.id, 1);
+			E->e[n++] = ev;
+			break;
+		default :
+			// dead service
+			message_delete(msg);
+			break;
+		}
+	}
+	E->n = n;
+}
+
 static void
 schedule_dispatch(struct ltask *task) {
+	uint64_t start = task->latency_dispatch ? systime_counter() : 0;
 	// Step 0 : check mainthread service id
 	struct mainthread_session * mt = &task->mt;
 	service_id id = { atomic_int_load(&mt->ready) };
@@ -484,11 +766,14 @@ schedule_dispatch(struct ltask *task) {
 		schedule_back(task, id);
 	}
 
-	// Step 1 : dispatch external messages
+	// Step 1 : dispatch external messages and expired timers
 
 	if (task->external_message) {
 		dispatch_external_messages(task);
 	}
+	if (task->timer) {
+		dispatch_timer(task);
+	}
 
 	// Step 2 : Collect service_done
 	service_id jobs[MAX_WORKER];
@@ -506,14 +791,19 @@ schedule_dispatch(struct ltask *task) {
 
 	assert(free_slot >= job_n);
 
-	// Step 6: Assign task to workers
-	int prepare_n = prepare_task(task, jobs, free_slot - job_n, job_n);
+	// Step 6: Assign task to workers, the parked services of groups first
+	int prepare_n = prepare_group_pending(task, jobs, free_slot - job_n, job_n);
+	prepare_n = prepare_task(task, jobs, free_slot - prepare_n, prepare_n);
 
 	// Step 7
 	assign_prepare_task(task, jobs, prepare_n);
 
 	// Step 8
 	trigger_blocked_workers(task);
+
+	if (task->latency_dispatch) {
+		histogram_record(task->latency_dispatch, systime_counter() - start);
+	}
 }
 
 // 0 succ
@@ -521,17 +811,21 @@ static int
 acquire_scheduler(struct worker_thread * worker) {
 	if (atomic_int_cas(&worker->task->schedule_owner, THREAD_NONE, THREAD_WORKER(worker->worker_id))) {
 		debug_printf(worker->logger, "Acquire schedule");
+		trace_event(worker->task, worker->worker_id, TRACE_SCHEDULE_ACQUIRE, 0, 0);
+		atomic_int_inc(&worker->metrics.acquire);
 #ifdef TIMELOG
 		worker->schedule_time = systime_thread();
 #endif
 		return 0;
 	}
+	atomic_int_inc(&worker->metrics.contention);
 	return 1;
 }
 
 static void
 release_scheduler(struct worker_thread * worker) {
 	assert(atomic_int_load(&worker->task->schedule_owner) == THREAD_WORKER(worker->worker_id));
+	trace_event(worker->task, worker->worker_id, TRACE_SCHEDULE_RELEASE, 0, 0);
 	atomic_int_store(&worker->task->schedule_owner, THREAD_NONE);
 #ifdef TIMELOG
 	uint64_t t = systime_thread() - worker->schedule_time;
@@ -545,24 +839,57 @@ release_scheduler(struct worker_thread * worker) {
 static int
 acquire_scheduler_mainthread(struct ltask *task) {
 	if (atomic_int_cas(&task->schedule_owner, THREAD_NONE, THREAD_MAINTHREAD)) {
+		trace_event(task, -1, TRACE_SCHEDULE_ACQUIRE, 0, 0);
+		atomic_int_inc(&task->mt_metrics.acquire);
 		return 0;
 	}
+	atomic_int_inc(&task->mt_metrics.contention);
 	return 1;
 }
 
 static void
 release_scheduler_mainthread(struct ltask *task) {
 	assert(atomic_int_load(&task->schedule_owner) == THREAD_MAINTHREAD);
+	trace_event(task, -1, TRACE_SCHEDULE_RELEASE, 0, 0);
 	atomic_int_store(&task->schedule_owner, THREAD_NONE);
 }
 
+static service_id
+steal_job_from(struct worker_thread * worker, int from) {
+	struct ltask *task = worker->task;
+	service_id job = { atomic_int_load(&task->workers[from].service_ready) };
+	if (job.id == 0 || !worker_eligible(task, worker->worker_id, service_group_get(task->services, job))) {
+		service_id fail = { 0 };
+		return fail;
+	}
+	job = worker_steal_job(&task->workers[from], task->services);
+	if (job.id && !worker_eligible(task, worker->worker_id, service_group_get(task->services, job))) {
+		// service_ready changed, not for this group
+		schedule_back(task, job);
+		job.id = 0;
+	}
+	return job;
+}
+
 static service_id
 steal_job(struct worker_thread * worker) {
+	struct ltask *task = worker->task;
+	const int *node = task->config->node;
 	int i;
-	for (i=0;i<worker->task->config->worker;i++) {
-		service_id job = worker_steal_job(&worker->task->workers[i], worker->task->services);
-		if (job.id)
-			return job;
+	// steal from the workers of the same NUMA node first
+	for (i=0;i<task->config->worker_max;i++) {
+		if (node[i] == node[worker->worker_id]) {
+			service_id job = steal_job_from(worker, i);
+			if (job.id)
+				return job;
+		}
+	}
+	for (i=0;i<task->config->worker_max;i++) {
+		if (node[i] != node[worker->worker_id]) {
+			service_id job = steal_job_from(worker, i);
+			if (job.id)
+				return job;
+		}
 	}
 	service_id fail = { 0 };
 	return fail;
@@ -574,15 +901,15 @@ schedule_dispatch_worker(struct worker_thread *worker) {
 	schedule_dispatch(worker->task);
 	if (!worker_has_job(worker)) {
 		// no job to do
-		if (worker->binding.id) {
-			// bind a service
+		if (worker->binding.id || atomic_int_load(&worker->retire)) {
+			// bind a service, or retired
 			return 1;
 		} else {
 			// steal a job
 			service_id job = steal_job(worker);
 			if (job.id) {
 				debug_printf(worker->logger, "Steal service %x", job.id);
-				atomic_int_store(&worker->service_ready, job.id);
+				worker_set_job(worker, job);
 			} else {
 				// steal fail
 				return 1;
@@ -593,10 +920,52 @@ schedule_dispatch_worker(struct worker_thread *worker) {
 	return 0;
 }
 
+#define SPIN_BACKOFF 64
+#define SPIN_SHRINK 16
+
+// 1 : no job, go to sleep
+static int
+worker_spin(struct worker_thread *w) {
+	const int spin_max = w->task->config->spin;
+	if (spin_max <= 0)
+		return 1;
+	int spin = w->spin;
+	int backoff = 1;
+	int i, j;
+	for (i=0;i<spin;i+=backoff) {
+		if (w->term_signal || atomic_int_load(&w->retire))
+			return 1;
+		if (worker_has_job(w))
+			goto _job;
+		for (j=0;j<backoff;j++) {
+			atomic_pause();
+		}
+		if (backoff < SPIN_BACKOFF) {
+			backoff *= 2;
+		} else if (!acquire_scheduler(w)) {
+			int nojob = schedule_dispatch_worker(w);
+			release_scheduler(w);
+			if (!nojob)
+				goto _job;
+		}
+	}
+	// spin fail, spin less next time
+	w->spin = spin / 2;
+	if (w->spin < spin_max / SPIN_SHRINK + 1)
+		w->spin = spin_max / SPIN_SHRINK + 1;
+	return 1;
+_job:
+	// jobs come often, spin more next time
+	w->spin = spin * 2;
+	if (w->spin > spin_max)
+		w->spin = spin_max;
+	return 0;
+}
+
 static void
 wakeup_all_workers(struct ltask *task) {
 	int i;
-	for (i=0;i<task->config->worker;i++) {
+	for (i=0;i<task->config->worker_max;i++) {
 		worker_wakeup(&task->workers[i]);
 	}
 }
@@ -604,7 +973,7 @@ wakeup_all_workers(struct ltask *task) {
 static void
 quit_all_workers(struct ltask *task) {
 	int i;
-	for (i=0;i<task->config->worker;i++) {
+	for (i=0;i<task->config->worker_max;i++) {
 		task->workers[i].term_signal = 1;
 	}
 }
@@ -686,6 +1055,11 @@ thread_worker(void *ud) {
 
 	sig_register(crash_log_worker, w);
 
+	int cpu = w->task->config->cpu[w->worker_id];
+	if (cpu >= 0 && sysinfo_bindcpu(cpu)) {
+		debug_printf(w->logger, "Can't bind worker %x to cpu %d", w->worker_id, cpu);
+	}
+
 	debug_printf(w->logger, "Start worker %x", w->worker_id);
 
 	for (;;) {
@@ -693,10 +1067,15 @@ thread_worker(void *ud) {
 			// quit
 			break;
 		}
+		if (atomic_int_load(&w->retire) && !worker_has_job(w)) {
+			debug_printf(w->logger, "Retire");
+			break;
+		}
 		service_id id = worker_get_job(w);
 		int dead = 0;
 		if (id.id) {
 			w->busy = 1;
+			bitmap_set(&w->state->busy, w->worker_id);
 			w->running = id;
 			if (w->waiting.id == id.id) {
 				w->waiting.id = 0;
@@ -706,7 +1085,28 @@ thread_worker(void *ud) {
 				debug_printf(w->logger, "Run service %x", id.id);
 				assert(status == SERVICE_STATUS_SCHEDULE);
 				service_status_set(P, id, SERVICE_STATUS_RUNNING);
-				if (service_resume(P, id)) {
+				service_worker_set(P, id, w->worker_id);
+				if (service_deadline_check(P, id)) {
+					atomic_int_inc(&w->task->deadline_miss);
+				}
+				if (w->task->latency_queue) {
+					uint64_t t = service_runnable_latency(P, id);
+					if (t)
+						histogram_record(w->task->latency_queue, t);
+				}
+				trace_event(w->task, w->worker_id, TRACE_RESUME, id.id, 0);
+				uint64_t start = systime_counter();
+				atomic_int_store(&w->resume_id, id.id);
+				atomic_u64_store(&w->resume_time, start);
+				if (w->task->config->watchdog > 0)
+					service_watchdog_watch(P, id, &w->alarm, start);
+				int quit = service_resume(P, id);
+				atomic_u64_store(&w->resume_time, 0);
+				atomic_u64_store(&w->alarm, 0);
+				atomic_u64_add(&w->metrics.busy, systime_counter() - start);
+				atomic_int_inc(&w->metrics.resume);
+				trace_event(w->task, w->worker_id, TRACE_YIELD, id.id, 0);
+				if (quit) {
 					dead = 1;
 					debug_printf(w->logger, "Service %x quit", id.id);
 					service_status_set(P, id, SERVICE_STATUS_DEAD);
@@ -731,6 +1131,7 @@ thread_worker(void *ud) {
 				debug_printf(w->logger, "Service %x is dead", id.id);
 			}
 			w->busy = 0;
+			bitmap_clear(&w->state->busy, w->worker_id);
 
 			// check binding
 
@@ -767,19 +1168,26 @@ thread_worker(void *ud) {
 				}
 			} while (w->service_done);	// retry if no one clear done flag
 
-			if (nojob && !w->task->blocked_service) {
+			if (nojob && !w->task->blocked_service && worker_spin(w)) {
 				// go to sleep
 				atomic_int_dec(&w->task->active_worker);
 				debug_printf(w->logger, "Sleeping (%d)", w->task->active_worker);
+				trace_event(w->task, w->worker_id, TRACE_SLEEP, 0, 0);
+				uint64_t start = systime_counter();
 				worker_sleep(w);
+				atomic_u64_add(&w->metrics.idle, systime_counter() - start);
+				atomic_int_inc(&w->metrics.wakeup);
+				trace_event(w->task, w->worker_id, TRACE_WAKEUP, 0, 0);
 				atomic_int_inc(&w->task->active_worker);
 				debug_printf(w->logger, "Wakeup");
 			}
 		}
 	}
 	worker_quit(w);
+	atomic_int_dec(&w->task->active_worker);
 	atomic_int_dec(&w->task->thread_count);
 	debug_printf(w->logger, "Quit");
+	atomic_int_store(&w->alive, 0);
 }
 
 static int
@@ -802,16 +1210,64 @@ ltask_init(lua_State *L) {
 	struct ltask *task = (struct ltask *)lua_newuserdatauv(L, sizeof(*task), 0);
 	lua_setfield(L, LUA_REGISTRYINDEX, "LTASK_GLOBAL");
 
-	task->lqueue = logqueue_new();
+	task->lqueue = logqueue_new(config->worker_max);
+	task->sink = NULL;
+	if (config->logfile[0]) {
+		task->sink = logsink_new(config->logfile, config->logfile_size);
+		if (task->sink == NULL)
+			return luaL_error(L, "Can't open logfile %s", config->logfile);
+	}
 #ifdef DEBUGLOG
 	task->logger = dlog_new("SCHEDULE", -1);
 #endif
 	task->config = config;
-	task->workers = (struct worker_thread *)lua_newuserdatauv(L, config->worker * sizeof(struct worker_thread), 0);
+	task->workers = (struct worker_thread *)lua_newuserdatauv(L, config->worker_max * sizeof(struct worker_thread), 0);
 	lua_setfield(L, LUA_REGISTRYINDEX, "LTASK_WORKERS");
 	task->services = service_create(config);
 	task->schedule = queue_new_int(config->max_service);
+	int g;
+	for (g=0;g<MAX_GROUP;g++) {
+		task->group_pending[g] = config->group_n > 1 && g < config->group_n ? queue_new_int(config->max_service) : NULL;
+	}
 	task->timer = NULL;
+	task->expired.n = 0;
+	task->expired.cap = 0;
+	task->expired.gen = 0;
+	task->expired.e = NULL;
+	task->expired.blocked = NULL;
+	task->graph = commgraph_new(config->commgraph, config->max_service);
+	struct logfilter_config lc = {
+		config->log_rate,
+		config->log_site_rate,
+		config->log_sample,
+		config->log_summary,
+	};
+	task->logfilter = logfilter_new(&lc, config->max_service);
+	task->edf = config->edf ? edf_new(config->max_service) : NULL;
+	task->edf_burst = 0;
+	task->latency_queue = NULL;
+	task->latency_dispatch = NULL;
+	task->trace = NULL;
+	if (config->trace_size > 0) {
+		// one more ring for mainthread
+		task->trace = trace_new(config->worker_max + 1, config->trace_size);
+		if (task->trace)
+			trace_enable(task->trace, config->trace);
+	}
+	if (config->histogram) {
+		task->latency_queue = (struct histogram *)malloc(sizeof(struct histogram));
+		task->latency_dispatch = (struct histogram *)malloc(sizeof(struct histogram));
+		if (task->latency_queue == NULL || task->latency_dispatch == NULL) {
+			// out of memory, no histogram
+			free(task->latency_queue);
+			free(task->latency_dispatch);
+			task->latency_queue = NULL;
+			task->latency_dispatch = NULL;
+		} else {
+			histogram_init(task->latency_queue);
+			histogram_init(task->latency_dispatch);
+		}
+	}
 	task->external_message = NULL;
 	task->external_last_message = NULL;
 	if (config->external_queue) {
@@ -835,13 +1291,19 @@ ltask_init(lua_State *L) {
 #endif
 
 	int i;
-	for (i=0;i<config->worker;i++) {
-		worker_init(&task->workers[i], task, i);
+	worker_state_init(&task->state);
+	task->worker_n = config->worker;
+	task->main_worker = -1;
+	for (i=0;i<config->worker_max;i++) {
+		worker_init(&task->workers[i], task, &task->state, i);
+		task->workers[i].spin = config->spin;
 	}
 
 	atomic_int_init(&task->schedule_owner, THREAD_NONE);
 	atomic_int_init(&task->active_worker, 0);
 	atomic_int_init(&task->thread_count, 0);
+	atomic_int_init(&task->deadline_miss, 0);
+	worker_metrics_init(&task->mt_metrics);
 
 	for (i=0;i<MAX_SOCKEVENT;i++) {
 		sockevent_init(&task->event[i]);
@@ -902,6 +1364,77 @@ thread_logger(void *ud) {
 	}
 }
 
+// Report the services run too long without yielding
+static void
+thread_watchdog(void *ud) {
+	struct ltask *t = (struct ltask *)ud;
+	thread_setname("ltask!watchdog");
+	const struct ltask_config *config = t->config;
+	const uint64_t threshold = (uint64_t)config->watchdog * systime_frequency() / 1000;
+	unsigned int period = config->watchdog / 4;
+	if (period == 0)
+		period = 1;
+	uint64_t reported[MAX_WORKER] = { 0 };
+	while (atomic_int_load(&t->thread_count) > 0) {
+		sys_sleep(period);
+		uint64_t now = systime_counter();
+		int i;
+		for (i=0;i<config->worker_max;i++) {
+			struct worker_thread *w = &t->workers[i];
+			uint64_t start = atomic_u64_load(&w->resume_time);
+			if (start == 0 || start == reported[i] || now - start < threshold)
+				continue;
+			service_id id = { atomic_int_load(&w->resume_id) };
+			if (atomic_u64_load(&w->resume_time) != start) {
+				// yield already
+				continue;
+			}
+			reported[i] = start;
+			// the service may be deleted, don't touch it here. the count hook of the service checks the alarm
+			fprintf(stderr, "WATCHDOG: service %x has been running for %.3fs on worker %d\n",
+				id.id, (double)(now - start) / systime_frequency(), i);
+			atomic_u64_store(&w->alarm, start);
+		}
+	}
+}
+
+#define LOGSINK_SLEEP 10
+
+static int
+drain_log(struct ltask *t) {
+	struct timer *TI = t->timer;
+	uint64_t start = 0;
+	if (TI) {
+		start = (uint64_t)timer_starttime(TI) * 100;
+	}
+	struct logmessage msg[LOGQUEUE_BATCH];
+	int n = 0;
+	int batch;
+	while ((batch = logqueue_popn(t->lqueue, msg, LOGQUEUE_BATCH)) > 0) {
+		int i;
+		for (i=0;i<batch;i++) {
+			logsink_write(t->sink, msg[i].timestamp + start, &msg[i]);
+		}
+		n += batch;
+	}
+	if (n > 0)
+		logsink_flush(t->sink);
+	return n;
+}
+
+static void
+thread_logsink(void *ud) {
+	struct ltask *t = (struct ltask *)ud;
+	thread_setname("ltask!logsink");
+	for (;;) {
+		int quit = atomic_int_load(&t->thread_count) == 0;
+		drain_log(t);
+		if (quit)
+			break;
+		sys_sleep(LOGSINK_SLEEP);
+	}
+}
+
 struct task_context {
 	int logthread;
 	int threads_count;
@@ -931,7 +1464,9 @@ ltask_run(lua_State *L) {
 		}
 	}
 
-	int threads_count = worker_n + logthread - usemainthread;
+	int watchdog = task->config->watchdog > 0;
+	int logsink = task->sink != NULL;
+	int threads_count = worker_n + logthread + watchdog + logsink - usemainthread;
 
 	struct task_context *ctx = (struct task_context *)lua_newuserdatauv(L, sizeof(*ctx) + (threads_count-1+usemainthread) * sizeof(struct thread), 0);
 
@@ -943,12 +1478,28 @@ ltask_run(lua_State *L) {
 	for (i=0;i<worker_n;i++) {
 		t[i].func = thread_worker;
 		t[i].ud = (void *)&task->workers[i];
+		atomic_int_store(&task->workers[i].alive, 1);
+	}
+	if (usemainthread) {
+		task->main_worker = mainthread >= 0 ? mainthread : 0;
 	}
 	task->thread_count = worker_n;
+	// other threads follow the workers
+	int index = worker_n;
 	if (logthread) {
-		int logthread_index = threads_count-1;
-		t[logthread_index].func = thread_logger;
-		t[logthread_index].ud = (void *)task;
+		t[index].func = thread_logger;
+		t[index].ud = (void *)task;
+		++index;
+	}
+	if (watchdog) {
+		t[index].func = thread_watchdog;
+		t[index].ud = (void *)task;
+		++index;
+	}
+	if (logsink) {
+		t[index].func = thread_logsink;
+		t[index].ud = (void *)task;
+		++index;
 	}
 	sig_init();
 	if (usemainthread && mainthread >= 0) {
@@ -966,11 +1517,24 @@ ltask_wait(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TUSERDATA);
 	struct task_context *ctx = (struct task_context *)lua_touserdata(L, 1);
 	thread_join(ctx->handle, ctx->threads_count);
+	int i;
+	for (i=0;i<ctx->task->config->worker_max;i++) {
+		struct worker_thread * w = &ctx->task->workers[i];
+		if (w->thread) {
+			thread_wait(w->thread);
+			w->thread = NULL;
+		}
+	}
 	if (ctx->logthread) {
 		close_logger(ctx->task);
 	}
+	if (ctx->task->sink) {
+		// the logs pushed after the last drain of thread_logsink
+		drain_log(ctx->task);
+	}
+	logsink_delete(ctx->task->sink);
+	ctx->task->sink = NULL;
 	logqueue_delete(ctx->task->lqueue);
-	int i;
 	for (i=0;i<MAX_SOCKEVENT;i++) {
 		sockevent_close(&ctx->task->event[i]);
 	}
@@ -987,13 +1551,25 @@ ltask_deinit(lua_State *L) {
 	struct ltask *task = (struct ltask *)get_ptr(L, "LTASK_GLOBAL");
 
 	int i;
-	for (i=0;i<task->config->worker;i++) {
+	for (i=0;i<task->config->worker_max;i++) {
 		worker_destroy(&task->workers[i]);
 	}
 
 	service_destroy(task->services);
 	queue_delete(task->schedule);
+	for (i=0;i<MAX_GROUP;i++) {
+		if (task->group_pending[i])
+			queue_delete(task->group_pending[i]);
+	}
 	timer_destroy(task->timer);
+	free(task->expired.e);
+	free(task->expired.blocked);
+	commgraph_delete(task->graph);
+	logfilter_delete(task->logfilter);
+	edf_delete(task->edf);
+	free(task->latency_queue);
+	free(task->latency_dispatch);
+	trace_delete(task->trace);
 
 	lua_pushnil(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, "LTASK_GLOBAL");
@@ -1002,7 +1578,7 @@ ltask_deinit(lua_State *L) {
 
 // 0 : succ
 static int
-newservice(lua_State *L, struct ltask *task, service_id id, const char *label, const char *source, size_t source_sz, const char *chunkname, int worker_id) {
+newservice(lua_State *L, struct ltask *task, service_id id, const char *label, const char *source, size_t source_sz, const char *chunkname, int worker_id, int group) {
 	struct service_ud ud;
 	ud.task = task;
 	ud.id = id;
@@ -1014,6 +1590,7 @@ newservice(lua_State *L, struct ltask *task, service_id id, const char *label, c
 		return -1;
 	}
 	service_binding_set(S, id, worker_id);
+	service_group_set(S, id, group);
 	if (service_setlabel(task->services, id, label)) {
 		service_delete(S, id);
 		lua_pushliteral(L, "set label fail");
@@ -1039,7 +1616,7 @@ ltask_newservice(lua_State *L) {
 	int worker_id = luaL_optinteger(L, 5, -1);
 
 	service_id id = service_new(task->services, sid);
-	if (newservice(L, task, id, label, source, source_sz, chunkname, worker_id)) {
+	if (newservice(L, task, id, label, source, source_sz, chunkname, worker_id, 0)) {
 		lua_pushboolean(L, 0);
 		lua_insert(L, -2);
 		return 2;
@@ -1078,6 +1655,8 @@ lpost_message(lua_State *L) {
 		lua_pop(L, 1);
 		msg.sz = checkfield(L, 1, "size");
 	}
+	msg.trace = 0;
+	msg.span = 0;
 	struct ltask *task = (struct ltask *)get_ptr(L, "LTASK_GLOBAL");
 	struct message * m = message_new(&msg);
 	if (service_push_message(task->services, msg.to, m)) {
@@ -1093,7 +1672,7 @@ ltask_init_timer(lua_State *L) {
 	struct ltask *task = (struct ltask *)get_ptr(L, "LTASK_GLOBAL");
 	if (task->timer)
 		return luaL_error(L, "Timer can init only once");
-	task->timer = timer_init();
+	task->timer = timer_init(task->config->worker_max);
 
 	return 0;
 }
@@ -1111,8 +1690,9 @@ ltask_init_root(lua_State *L) {
 	return 0;
 }
 
+// worker < 0 : not in a worker thread
 static int
-pushlog(struct ltask* task, service_id id, void *data, uint32_t sz) {
+pushlog_worker(struct ltask* task, int worker, service_id id, void *data, uint32_t sz) {
 	struct logmessage msg;
 	msg.id = id;
 	msg.msg = data;
@@ -1124,7 +1704,13 @@ pushlog(struct ltask* task, service_id id, void *data, uint32_t sz) {
 	} else {
 		msg.timestamp = timer_now(TI);
 	}
-	return logqueue_push(q, &msg);
+	return logqueue_push(q, worker, &msg);
+}
+
+// exported by get_pushlog, it may be called from any thread
+static int
+pushlog(struct ltask* task, service_id id, void *data, uint32_t sz) {
+	return pushlog_worker(task, -1, id, data, sz);
 }
 
 static int
@@ -1210,7 +1796,18 @@ lmainthread_wait(lua_State *L) {
 		
 		debug_printf(task->logger, "service %x run in mainthread", id.id);
 		assert(service_status_get(P, id) == SERVICE_STATUS_MAINTHREAD);
-		if (service_resume(P, id)) {
+		if (task->latency_queue) {
+			uint64_t t = service_runnable_latency(P, id);
+			if (t)
+				histogram_record(task->latency_queue, t);
+		}
+		trace_event(task, -1, TRACE_RESUME, id.id, 0);
+		uint64_t start = systime_counter();
+		int quit = service_resume(P, id);
+		atomic_u64_add(&task->mt_metrics.busy, systime_counter() - start);
+		atomic_int_inc(&task->mt_metrics.resume);
+		trace_event(task, -1, TRACE_YIELD, id.id, 0);
+		if (quit) {
 			// dead
 			debug_printf(task->logger, "service %x is dead in mainthread", id.id);
 			service_status_set(P, id, SERVICE_STATUS_DEAD);
@@ -1283,12 +1880,7 @@ getS(lua_State *L) {
 	return ud;
 }
 
-// Timer
-
-struct timer_event {
-	session_t session;
-	service_id id;
-};
+// Timer, the expired timers are sent by the scheduler (see dispatch_timer)
 
 static int
 ltask_timer_add(lua_State *L) {
@@ -1304,47 +1896,22 @@ ltask_timer_add(lua_State *L) {
 	if (ti < 0 || ti != (int)ti)
 		return luaL_error(L, "Invalid timer %d", ti);
 
-	timer_add(t, &ev, sizeof(ev), ti);
-	return 0;
-}
-
-struct timer_update_ud {
-	lua_State *L;
-	int n;
-};
-
-static void
-timer_callback(void *ud, void *arg) {
-	struct timer_update_ud *tu = (struct timer_update_ud *)ud;
-	struct timer_event *event = (arg);
-	lua_State *L = tu->L;
-	uint64_t v = event->session;
-	v = v << 32 | event->id.id;
-	lua_pushinteger(L, v);
-	int idx = ++tu->n;
-	lua_seti(L, 1, idx);
+	uint64_t handle = timer_add(t, get_worker_id(S->task, S->id), &ev, sizeof(ev), ti);
+	if (handle == 0)
+		return luaL_error(L, "Out of memory for timer");
+	lua_pushinteger(L, (lua_Integer)handle);
+	return 1;
 }
 
+// returns true if the timer is cancelled, false if the response has been sent or will be sent
 static int
-ltask_timer_update(lua_State *L) {
+ltask_timer_cancel(lua_State *L) {
 	const struct service_ud *S = getS(L);
 	struct timer *t = S->task->timer;
 	if (t == NULL)
 		return luaL_error(L, "Init timer before bootstrap");
-	if (lua_gettop(L) > 1) {
-		lua_settop(L, 1);
-		luaL_checktype(L, 1, LUA_TTABLE);
-	}
-	struct timer_update_ud tu;
-	tu.L = L;
-	tu.n = 0;
-	timer_update(t, timer_callback, &tu);
-	int n = lua_rawlen(L, 1);
-	int i;
-	for (i=tu.n+1;i<=n;i++) {
-		lua_pushnil(L);
-		lua_seti(L, 1, i);
-	}
+	uint64_t handle = (uint64_t)luaL_checkinteger(L, 1);
+	lua_pushboolean(L, timer_cancel(t, get_worker_id(S->task, S->id), handle) == 0);
 	return 1;
 }
 
@@ -1363,6 +1930,8 @@ gen_send_message(lua_State *L, service_id id) {
 		m.msg = lua_touserdata(L, 4);
 		m.sz = (size_t)luaL_checkinteger(L, 5);
 	}
+	m.trace = (unsigned int)luaL_optinteger(L, 6, 0);
+	m.span = (unsigned int)luaL_optinteger(L, 7, 0);
 
 	return message_new(&m);
 }
@@ -1373,6 +1942,8 @@ gen_send_message(lua_State *L, service_id id) {
 	integer type
 	pointer message
 	integer sz
+	integer trace (optional)
+	integer span (optional)
  */
 static inline int
 lsend_message(lua_State *L) {
@@ -1396,6 +1967,7 @@ lrecv_message(lua_State *L) {
 	struct message *m = service_pop_message(S->task->services, S->id);
 	if (m == NULL)
 		return 0;
+	trace_event(S->task, get_worker_id(S->task, S->id), TRACE_RECV, S->id.id, m->from.id);
 	int r = 3;
 	lua_pushinteger(L, m->from.id);
 	lua_pushinteger(L, m->session);
@@ -1412,6 +1984,55 @@ lrecv_message(lua_State *L) {
 	return r;
 }
 
+#define RECV_STRIDE 7
+
+/*
+	table buffer
+	integer n
+	return count ; buffer[i*7+1 .. i*7+7] = from, session, type, message, sz, trace, span
+ */
+static int
+lrecv_messages(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int n = (int)luaL_checkinteger(L, 2);
+	int worker = get_worker_id(S->task, S->id);
+	int i;
+	for (i=0;i<n;i++) {
+		struct message *m = service_pop_message(S->task->services, S->id);
+		if (m == NULL)
+			break;
+		trace_event(S->task, worker, TRACE_RECV, S->id.id, m->from.id);
+		int base = i * RECV_STRIDE;
+		lua_pushinteger(L, m->from.id);
+		lua_rawseti(L, 1, base + 1);
+		lua_pushinteger(L, m->session);
+		lua_rawseti(L, 1, base + 2);
+		lua_pushinteger(L, m->type);
+		lua_rawseti(L, 1, base + 3);
+		if (m->msg) {
+			lua_pushlightuserdata(L, m->msg);
+			lua_rawseti(L, 1, base + 4);
+			lua_pushinteger(L, m->sz);
+			lua_rawseti(L, 1, base + 5);
+			m->msg = NULL;
+			m->sz = 0;
+		} else {
+			lua_pushnil(L);
+			lua_rawseti(L, 1, base + 4);
+			lua_pushnil(L);
+			lua_rawseti(L, 1, base + 5);
+		}
+		lua_pushinteger(L, m->trace);
+		lua_rawseti(L, 1, base + 6);
+		lua_pushinteger(L, m->span);
+		lua_rawseti(L, 1, base + 7);
+		message_delete(m);
+	}
+	lua_pushinteger(L, i);
+	return 1;
+}
+
 static inline int
 lmessage_receipt(lua_State *L) {
 	const struct service_ud *S = getS(L);
@@ -1477,7 +2098,7 @@ lworker_bind(lua_State *L) {
 		return 0;
 	}
 	int	worker = luaL_checkinteger(L, 1);
-	if (worker < 0 || worker >= S->task->config->worker) {
+	if (worker < 0 || worker >= S->task->worker_n) {
 		return luaL_error(L, "Invalid worker id %d", worker);
 	}
 	service_binding_set(S->task->services, S->id, worker);
@@ -1506,14 +2127,329 @@ ltask_counter(lua_State *L) {
 	return 1;
 }
 
+// ms from now, nil : clear
+static int
+ltask_deadline(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	uint64_t deadline = 0;
+	if (!lua_isnoneornil(L, 1)) {
+		uint64_t freq = lua_tointeger(L, lua_upvalueindex(2));
+		lua_Integer ms = luaL_checkinteger(L, 1);
+		if (ms < 0)
+			ms = 0;
+		deadline = systime_counter() + ms * freq / 1000;
+	}
+	service_deadline_set(S->task->services, S->id, deadline);
+	return 0;
+}
+
+// profile(ms) : sample lua stacks every ms of cpu time, 0 or nil : stop
+static int
+ltask_profile(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	uint64_t interval = 0;
+	if (!lua_isnoneornil(L, 1)) {
+		uint64_t freq = lua_tointeger(L, lua_upvalueindex(2));
+		lua_Number ms = luaL_checknumber(L, 1);
+		if (ms > 0) {
+			interval = (uint64_t)(ms * freq / 1000);
+			if (interval == 0)
+				interval = 1;
+		}
+	}
+	if (service_profile(S->task->services, S->id, L, interval))
+		return luaL_error(L, "Can't profile service %d", S->id.id);
+	return 0;
+}
+
+// returns folded stacks ("frame;frame;... count\n") for flamegraph, and resets the samples
+static int
+ltask_profile_dump(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct profile *p = service_profile_get(S->task->services, S->id);
+	if (p == NULL)
+		return 0;
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	int i;
+	int sz = profile_size(p);
+	for (i=0;i<sz;i++) {
+		const char *stack;
+		size_t n;
+		unsigned int count;
+		if (profile_entry(p, i, &stack, &n, &count)) {
+			luaL_addlstring(&b, stack, n);
+			lua_pushfstring(L, " %d\n", (int)count);
+			luaL_addvalue(&b);
+		}
+	}
+	profile_reset(p);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+// kind : "queue" (runnable to resume), "dispatch" (schedule_dispatch), nil (this service)
+static int
+ltask_latency(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	const char *kind = luaL_optstring(L, 1, NULL);
+	struct histogram *h;
+	if (kind == NULL) {
+		h = service_histogram(S->task->services, S->id);
+	} else if (strcmp(kind, "queue") == 0) {
+		h = S->task->latency_queue;
+	} else if (strcmp(kind, "dispatch") == 0) {
+		h = S->task->latency_dispatch;
+	} else {
+		return luaL_error(L, "Invalid latency kind %s", kind);
+	}
+	if (h == NULL)
+		return 0;
+	double freq = (double)lua_tointeger(L, lua_upvalueindex(2));
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, atomic_u64_load(&h->count));
+	lua_setfield(L, -2, "count");
+	static const struct { const char *name; double q; } p[] = {
+		{ "p50", 0.5 },
+		{ "p90", 0.9 },
+		{ "p99", 0.99 },
+		{ "p999", 0.999 },
+	};
+	int i;
+	for (i=0;i<(int)(sizeof(p)/sizeof(p[0]));i++) {
+		lua_pushnumber(L, histogram_percentile(h, p[i].q) / freq);
+		lua_setfield(L, -2, p[i].name);
+	}
+	lua_pushnumber(L, atomic_u64_load(&h->max) / freq);
+	lua_setfield(L, -2, "max");
+	return 1;
+}
+
+static void
+push_worker_metrics(lua_State *L, struct worker_metrics *m, double freq) {
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, atomic_u64_load(&m->busy) / freq);
+	lua_setfield(L, -2, "busy");
+	lua_pushnumber(L, atomic_u64_load(&m->idle) / freq);
+	lua_setfield(L, -2, "idle");
+	lua_pushinteger(L, atomic_int_load(&m->resume));
+	lua_setfield(L, -2, "resume");
+	lua_pushinteger(L, atomic_int_load(&m->wakeup));
+	lua_setfield(L, -2, "wakeup");
+	lua_pushinteger(L, atomic_int_load(&m->acquire));
+	lua_setfield(L, -2, "acquire");
+	lua_pushinteger(L, atomic_int_load(&m->contention));
+	lua_setfield(L, -2, "contention");
+}
+
+#define METRICS_SLACK 16
+
+// push a userdata of the snapshot, returns the number of services
+static int
+snapshot_services(lua_State *L, struct ltask *task, struct service_metrics **m) {
+	struct service_pool *P = task->services;
+	for (;;) {
+		int cap = service_count(P) + METRICS_SLACK;
+		*m = (struct service_metrics *)lua_newuserdatauv(L, cap * sizeof(struct service_metrics), 0);
+		// hold the scheduler only for copying, so the schedule doesn't change under the snapshot.
+		// root may still delete services, service_metrics takes the live lock against it
+		while (!atomic_int_cas(&task->schedule_owner, THREAD_NONE, THREAD_METRICS)) {
+			atomic_pause();
+		}
+		int n = service_metrics(P, *m, cap);
+		atomic_int_store(&task->schedule_owner, THREAD_NONE);
+		if (n <= cap)
+			return n;
+		// more services are created, try again
+		lua_pop(L, 1);
+	}
+}
+
+/*
+	return {
+		schedule = length of schedule queue,
+		active_worker = workers not sleeping,
+		workers = { { busy, idle, resume, wakeup, acquire, contention, alive }, ... },
+		mainthread = { busy, idle, resume, wakeup, acquire, contention },
+		services = { [id] = { mailbox, msg_in, msg_out, blocked } },
+	}
+	busy and idle are in seconds
+ */
+static int
+ltask_metrics(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct ltask *task = S->task;
+	double freq = (double)lua_tointeger(L, lua_upvalueindex(2));
+	struct service_metrics *sm;
+	int n = snapshot_services(L, task, &sm);
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, queue_length(task->schedule));
+	lua_setfield(L, -2, "schedule");
+	lua_pushinteger(L, atomic_int_load(&task->active_worker));
+	lua_setfield(L, -2, "active_worker");
+	const int worker_n = task->config->worker_max;
+	lua_createtable(L, worker_n, 0);
+	int i;
+	for (i=0;i<worker_n;i++) {
+		struct worker_thread *w = &task->workers[i];
+		push_worker_metrics(L, &w->metrics, freq);
+		lua_pushboolean(L, atomic_int_load(&w->alive));
+		lua_setfield(L, -2, "alive");
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_setfield(L, -2, "workers");
+	push_worker_metrics(L, &task->mt_metrics, freq);
+	lua_setfield(L, -2, "mainthread");
+	lua_createtable(L, 0, n);
+	for (i=0;i<n;i++) {
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, sm[i].mailbox);
+		lua_setfield(L, -2, "mailbox");
+		lua_pushinteger(L, sm[i].msg_in);
+		lua_setfield(L, -2, "msg_in");
+		lua_pushinteger(L, sm[i].msg_out);
+		lua_setfield(L, -2, "msg_out");
+		lua_pushinteger(L, sm[i].blocked);
+		lua_setfield(L, -2, "blocked");
+		lua_rawseti(L, -2, sm[i].id.id);
+	}
+	lua_setfield(L, -2, "services");
+	return 1;
+}
+
+static int
+ltask_deadline_miss(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	lua_pushinteger(L, service_deadline_miss(S->task->services, S->id));
+	lua_pushinteger(L, atomic_int_load(&S->task->deadline_miss));
+	return 2;
+}
+
+// trace(enable) : set or get the state of trace
+static int
+ltask_trace(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct trace *t = S->task->trace;
+	if (t == NULL)
+		return 0;
+	if (!lua_isnoneornil(L, 1)) {
+		trace_enable(t, lua_toboolean(L, 1));
+	}
+	lua_pushboolean(L, trace_enabled(t));
+	return 1;
+}
+
+static int
+ltask_trace_dump(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	const char *filename = luaL_checkstring(L, 1);
+	struct trace *t = S->task->trace;
+	if (t == NULL)
+		return luaL_error(L, "trace is disabled (trace_size = 0)");
+	FILE *f = fopen(filename, "wb");
+	if (f == NULL)
+		return luaL_error(L, "Can't open %s", filename);
+	int n = trace_dump(t, f, S->task->services);
+	fclose(f);
+	if (n < 0)
+		return luaL_error(L, "Out of memory");
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+// returns a new span id and the start time, nil if trace is disabled
+static int
+ltask_span_new(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct trace *t = S->task->trace;
+	if (t == NULL || !trace_enabled(t))
+		return 0;
+	lua_pushinteger(L, trace_span_new(t));
+	lua_pushinteger(L, (lua_Integer)systime_counter());
+	return 2;
+}
+
+// span_record(trace, span, parent, start)
+static int
+ltask_span_record(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct trace *t = S->task->trace;
+	if (t == NULL)
+		return 0;
+	unsigned int trace = (unsigned int)luaL_checkinteger(L, 1);
+	unsigned int span = (unsigned int)luaL_checkinteger(L, 2);
+	unsigned int parent = (unsigned int)luaL_checkinteger(L, 3);
+	uint64_t start = (uint64_t)luaL_checkinteger(L, 4);
+	trace_span_record(t, trace, span, parent, S->id.id, start);
+	return 0;
+}
+
+// ltask.log.xxx -> pushlog (service.lua) -> ltask.pushlog
+#define LOG_CALLSITE_LEVEL 3
+
+// 0 : pass, 1 : drop
+static int
+log_filter(lua_State *L, struct logfilter *f, service_id id, int level, uint64_t now) {
+	const void *site = NULL;
+	int line = 0;
+	lua_Debug ar;
+	if (logfilter_site(f) && lua_getstack(L, level, &ar) && lua_getinfo(L, "Sl", &ar)) {
+		// the source string lives as long as the function
+		site = ar.source;
+		line = ar.currentline;
+	}
+	return logfilter_check(f, id, site, line, now);
+}
+
+static void
+log_push(lua_State *L, const struct service_ud *S, void *data, uint32_t sz) {
+	if (pushlog_worker(S->task, get_worker_id(S->task, S->id), S->id, data, sz)) {
+		luaL_error(L, "log error");
+	}
+}
+
+static void
+log_dropped(lua_State *L, const struct service_ud *S, uint64_t now) {
+	int n = logfilter_dropped(S->task->logfilter, S->id, now);
+	if (n == 0)
+		return;
+	// the same layout as ltask.log.warnf
+	lua_settop(L, 0);
+	lua_pushstring(L, "warn");
+	lua_pushstring(L, "%d logs dropped");
+	lua_pushstring(L, service_getlabel(S->task->services, S->id));
+	lua_pushinteger(L, n);
+	luaseri_pack(L);
+	log_push(L, S, lua_touserdata(L, -2), (uint32_t)lua_tointeger(L, -1));
+}
+
+// ltask.pushlog(level, fmt, label, ...) packs the values only if the log passes the limits,
+// ltask.pushlog(msg, sz) is the packed form.
 static int
 ltask_pushlog(lua_State *L) {
-	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
-	void* data = lua_touserdata(L, 1);
-	uint32_t sz = (uint32_t)luaL_checkinteger(L, 2);
 	const struct service_ud *S = getS(L);
-	if (pushlog(S->task, S->id, data, sz)) {
-		return luaL_error(L, "log error");
+	struct logfilter *f = S->task->logfilter;
+	int packed = lua_type(L, 1) == LUA_TLIGHTUSERDATA;
+	uint64_t now = 0;
+	int drop = 0;
+	if (f) {
+		now = systime_mono();
+		drop = log_filter(L, f, S->id, packed ? 1 : LOG_CALLSITE_LEVEL, now);
+	}
+	if (packed) {
+		void* data = lua_touserdata(L, 1);
+		uint32_t sz = (uint32_t)luaL_checkinteger(L, 2);
+		if (drop) {
+			free(data);
+		} else {
+			log_push(L, S, data, sz);
+		}
+	} else if (!drop) {
+		luaseri_pack(L);
+		log_push(L, S, lua_touserdata(L, -2), (uint32_t)lua_tointeger(L, -1));
+	}
+	if (f) {
+		log_dropped(L, S, now);
 	}
 	return 0;
 }
@@ -1528,6 +2464,10 @@ ltask_poplog(lua_State *L) {
 	if (TI) {
 		start = (uint64_t)timer_starttime(TI) * 100;
 	}
+	if (S->task->sink) {
+		// logs are written by thread_logsink
+		return 0;
+	}
 	if (logqueue_pop(q, &msg))
 		return 0;
 	lua_pushinteger(L, msg.timestamp + start);
@@ -1617,6 +2557,47 @@ ltask_cpucost(lua_State *L) {
 	return 1;
 }
 
+// the scheduler writes the graph, copy it while holding the scheduler
+static int
+snapshot_commgraph(lua_State *L, struct ltask *task, struct commgraph_edge **e) {
+	struct commgraph *g = task->graph;
+	for (;;) {
+		int cap = commgraph_size(g) + METRICS_SLACK;
+		*e = (struct commgraph_edge *)lua_newuserdatauv(L, cap * sizeof(struct commgraph_edge), 0);
+		while (!atomic_int_cas(&task->schedule_owner, THREAD_NONE, THREAD_METRICS)) {
+			atomic_pause();
+		}
+		int n = commgraph_edges(g, *e, cap);
+		atomic_int_store(&task->schedule_owner, THREAD_NONE);
+		if (n <= cap)
+			return n;
+		lua_pop(L, 1);
+	}
+}
+
+static int
+ltask_commgraph(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct ltask *task = S->task;
+	if (task->graph == NULL)
+		return 0;
+	struct commgraph_edge *e;
+	int n = snapshot_commgraph(L, task, &e);
+	lua_createtable(L, n, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, e[i].from.id);
+		lua_setfield(L, -2, "from");
+		lua_pushinteger(L, e[i].to.id);
+		lua_setfield(L, -2, "to");
+		lua_pushinteger(L, e[i].count);
+		lua_setfield(L, -2, "count");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
 static int
 alloc_sockevent(struct ltask *task) {
 	int i;
@@ -1690,7 +2671,7 @@ ltask_debuglog(lua_State *L) {
 	const struct service_ud *S = getS(L);
 	struct debug_logger *dl = NULL;
 	int i;
-	for (i=0;i<S->task->config->worker;i++) {
+	for (i=0;i<S->task->config->worker_max;i++) {
 		if (S->task->workers[i].running.id == S->id.id) {
 			dl = S->task->workers[i].logger;
 			break;
@@ -1766,13 +2747,14 @@ luaopen_ltask(lua_State *L) {
 	luaL_Reg l2[] = {
 		{ "send_message", lsend_message },
 		{ "recv_message", lrecv_message },
+		{ "recv_messages", lrecv_messages },
 		{ "message_receipt", lmessage_receipt },
 		{ "touch_service", ltask_touch_service },
 		{ "self", lself },
 		{ "worker_id", lworker_id },
 		{ "worker_bind", lworker_bind },
 		{ "timer_add", ltask_timer_add },
-		{ "timer_update", ltask_timer_update },
+		{ "timer_cancel", ltask_timer_cancel },
 		{ "now", ltask_now },
 		{ "pushlog", ltask_pushlog },
 		{ "poplog", ltask_poplog },
@@ -1781,6 +2763,13 @@ luaopen_ltask(lua_State *L) {
 		{ "mem_count", ltask_memcount },
 		{ "label", ltask_label },
 		{ "backtrace", lbacktrace },
+		{ "commgraph", ltask_commgraph },
+		{ "deadline_miss", ltask_deadline_miss },
+		{ "trace", ltask_trace },
+		{ "trace_dump", ltask_trace_dump },
+		{ "span_new", ltask_span_new },
+		{ "span_record", ltask_span_record },
+		{ "profile_dump", ltask_profile_dump },
 		{ "debuglog", ltask_debuglog },
 		{ "eventinit", ltask_eventinit },
 		{ "eventreset", ltask_eventreset },
@@ -1804,6 +2793,10 @@ luaopen_ltask(lua_State *L) {
 	luaL_Reg l3[] = {
 		{ "counter", ltask_counter },
 		{ "cpucost", ltask_cpucost },
+		{ "deadline", ltask_deadline },
+		{ "latency", ltask_latency },
+		{ "profile", ltask_profile },
+		{ "metrics", ltask_metrics },
 		{ NULL, NULL },
 	};
 
@@ -1825,9 +2818,16 @@ ltask_initservice(lua_State *L) {
 	const char *source = luaL_checklstring(L, 3, &source_sz);
 	const char *chunkname = luaL_checkstring(L, 4);
 	int worker_id = luaL_optinteger(L, 5, -1);
+	int group = 0;
+	if (!lua_isnoneornil(L, 6)) {
+		const char *name = luaL_checkstring(L, 6);
+		group = config_group(S->task->config, name);
+		if (group < 0)
+			return luaL_error(L, "Unknown worker group %s", name);
+	}
 
 	service_id id = { sid };
-	if (newservice(L, S->task, id, label, source, source_sz, chunkname, worker_id)) {
+	if (newservice(L, S->task, id, label, source, source_sz, chunkname, worker_id, group)) {
 		lua_pushboolean(L, 0);
 		lua_insert(L, -2);
 		return 2;
@@ -1882,6 +2882,93 @@ ltask_closeservice(lua_State *L) {
 	return ret;
 }
 
+static void
+retire_worker(struct ltask *task, int worker) {
+	struct worker_thread * w = &task->workers[worker];
+	atomic_int_store(&w->retire, 1);
+	// take the ready job back, or the worker will run it before quit
+	int job = atomic_int_load(&w->service_ready);
+	if (job && atomic_int_cas(&w->service_ready, job, 0)) {
+		service_id id = { job };
+		bitmap_clear(&task->state.ready, worker);
+		schedule_back(task, id);
+	}
+	// services bound to the worker run on the others until it's started again, see prepare_task
+	struct binding_service * q = &(w->binding_queue);
+	while (!binding_queue_empty(q)) {
+		schedule_back(task, binding_queue_pop(q));
+	}
+	bitmap_clear(&task->state.queued, worker);
+	worker_wakeup(w);
+	debug_printf(task->logger, "Retire worker %d", worker);
+}
+
+// 0 : succ
+static int
+start_worker(struct ltask *task, int worker) {
+	struct worker_thread * w = &task->workers[worker];
+	if (atomic_int_load(&w->alive)) {
+		// the retired worker is still running its last job
+		return 1;
+	}
+	if (w->thread) {
+		thread_wait(w->thread);
+		w->thread = NULL;
+	}
+	atomic_int_store(&w->retire, 0);
+	w->binding.id = 0;
+	w->waiting.id = 0;
+	atomic_int_store(&w->alive, 1);
+	atomic_int_inc(&task->thread_count);
+	struct thread t = { thread_worker, (void *)w };
+	w->thread = thread_run(t);
+	if (w->thread == NULL) {
+		atomic_int_store(&w->alive, 0);
+		atomic_int_dec(&task->thread_count);
+		return 1;
+	}
+	debug_printf(task->logger, "Start worker %d", worker);
+	return 0;
+}
+
+static int
+ltask_worker_resize(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct ltask *task = S->task;
+	int n = (int)luaL_checkinteger(L, 1);
+	// the worker in main thread can't quit
+	int min_n = task->main_worker + 1;
+	if (min_n < 1)
+		min_n = 1;
+	// keep all the workers of named groups, and one worker for the default group
+	int i;
+	for (i=0;i<task->config->worker;i++) {
+		if (task->config->worker_group[i] != 0 && min_n < i + 2)
+			min_n = i + 2;
+	}
+	if (n < min_n || n > task->config->worker_max) {
+		return luaL_error(L, "Invalid worker number %d (%d - %d)", n, min_n, task->config->worker_max);
+	}
+	while (!atomic_int_cas(&task->schedule_owner, THREAD_NONE, THREAD_RESIZE)) {
+		atomic_pause();
+	}
+	if (n < task->worker_n) {
+		for (i=task->worker_n-1;i>=n;i--) {
+			retire_worker(task, i);
+		}
+	} else {
+		for (i=task->worker_n;i<n;i++) {
+			if (start_worker(task, i))
+				break;
+		}
+		n = i;
+	}
+	task->worker_n = n;
+	atomic_int_store(&task->schedule_owner, THREAD_NONE);
+	lua_pushinteger(L, n);
+	return 1;
+}
+
 LUAMOD_API int
 luaopen_ltask_root(lua_State *L) {
 	static atomic_int init = 0;
@@ -1894,6 +2981,7 @@ luaopen_ltask_root(lua_State *L) {
 		{ "init_service", ltask_initservice },
 		{ "close_service", ltask_closeservice },
 		{ "set_exit_code", ltask_set_exit_code },
+		{ "worker_resize", ltask_worker_resize },
 		{ NULL, NULL },
 	};
 	
@@ -31,6 +31,8 @@ struct message {
 	int type;
 	void *msg;
 	size_t sz;
+	unsigned int trace;	// trace id of the call chain, 0 : none
+	unsigned int span;	// span of the sender
 };
 
 struct message * message_new(struct message *msg);
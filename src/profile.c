@@ -0,0 +1,155 @@
+#include "profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_INIT_SIZE 64
+
+struct stack_entry {
+	char *stack;
+	size_t sz;
+	unsigned int hash;
+	unsigned int count;
+};
+
+struct profile {
+	uint64_t interval;
+	uint64_t next;
+	int n;
+	int cap;
+	struct stack_entry *e;
+};
+
+struct profile *
+profile_new() {
+	struct profile *p = (struct profile *)malloc(sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	p->interval = 0;
+	p->next = 0;
+	p->n = 0;
+	p->cap = 0;
+	p->e = NULL;
+	return p;
+}
+
+void
+profile_reset(struct profile *p) {
+	int i;
+	for (i=0;i<p->cap;i++) {
+		free(p->e[i].stack);
+	}
+	free(p->e);
+	p->n = 0;
+	p->cap = 0;
+	p->e = NULL;
+}
+
+void
+profile_delete(struct profile *p) {
+	if (p == NULL)
+		return;
+	profile_reset(p);
+	free(p);
+}
+
+void
+profile_interval(struct profile *p, uint64_t interval) {
+	p->interval = interval;
+	p->next = 0;
+}
+
+int
+profile_active(struct profile *p) {
+	return p->interval != 0;
+}
+
+int
+profile_tick(struct profile *p, uint64_t now) {
+	if (p->interval == 0 || now < p->next)
+		return 0;
+	p->next = now + p->interval;
+	return 1;
+}
+
+static unsigned int
+stack_hash(const char *stack, size_t sz) {
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h ^= (unsigned char)stack[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct stack_entry *
+find_slot(struct stack_entry *e, int cap, unsigned int hash, const char *stack, size_t sz) {
+	int i = hash & (cap - 1);
+	for (;;) {
+		struct stack_entry *s = &e[i];
+		if (s->stack == NULL)
+			return s;
+		if (s->hash == hash && s->sz == sz && memcmp(s->stack, stack, sz) == 0)
+			return s;
+		i = (i + 1) & (cap - 1);
+	}
+}
+
+// 0 : succ
+static int
+expand(struct profile *p) {
+	int cap = p->cap ? p->cap * 2 : PROFILE_INIT_SIZE;
+	struct stack_entry *e = (struct stack_entry *)calloc(cap, sizeof(struct stack_entry));
+	if (e == NULL)
+		return 1;
+	int i;
+	for (i=0;i<p->cap;i++) {
+		struct stack_entry *s = &p->e[i];
+		if (s->stack) {
+			*find_slot(e, cap, s->hash, s->stack, s->sz) = *s;
+		}
+	}
+	free(p->e);
+	p->e = e;
+	p->cap = cap;
+	return 0;
+}
+
+void
+profile_add(struct profile *p, const char *stack, size_t sz) {
+	// keep load factor below 3/4
+	if ((p->n + 1) * 4 > p->cap * 3 && expand(p))
+		return;
+	unsigned int hash = stack_hash(stack, sz);
+	struct stack_entry *s = find_slot(p->e, p->cap, hash, stack, sz);
+	if (s->stack == NULL) {
+		char *str = (char *)malloc(sz);
+		if (str == NULL)
+			return;
+		memcpy(str, stack, sz);
+		s->stack = str;
+		s->sz = sz;
+		s->hash = hash;
+		s->count = 0;
+		++p->n;
+	}
+	++s->count;
+}
+
+int
+profile_size(struct profile *p) {
+	return p->cap;
+}
+
+int
+profile_entry(struct profile *p, int index, const char **stack, size_t *sz, unsigned int *count) {
+	struct stack_entry *s = &p->e[index];
+	if (s->stack == NULL)
+		return 0;
+	*stack = s->stack;
+	*sz = s->sz;
+	*count = s->count;
+	return 1;
+}
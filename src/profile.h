@@ -0,0 +1,24 @@
+#ifndef ltask_profile_h
+#define ltask_profile_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sample counts of folded stacks ("root;...;leaf"), only the thread running the service touches it.
+
+struct profile;
+
+struct profile * profile_new();
+void profile_delete(struct profile *p);
+// interval in systime_thread, 0 : stop sampling
+void profile_interval(struct profile *p, uint64_t interval);
+int profile_active(struct profile *p);
+// 1 : time to take a sample
+int profile_tick(struct profile *p, uint64_t now);
+void profile_add(struct profile *p, const char *stack, size_t sz);
+int profile_size(struct profile *p);
+// 0 : empty slot
+int profile_entry(struct profile *p, int index, const char **stack, size_t *sz, unsigned int *count);
+void profile_reset(struct profile *p);
+
+#endif
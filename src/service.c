@@ -3,6 +3,9 @@
 #include "config.h"
 #include "message.h"
 #include "systime.h"
+#include "histogram.h"
+#include "profile.h"
+#include "spinlock.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -18,6 +21,7 @@ void LTASK_EXTERNAL_OPENLIBS(lua_State *L);
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 
 // test whether an unsigned value is a power of 2 (or zero)
 #define ispow2(x)	(((x) & ((x) - 1)) == 0)
@@ -58,18 +62,38 @@ struct service {
 	int status;
 	int receipt;
 	int binding_thread;
+	int last_worker;
+	int group;
 	int sockevent_id;
 	service_id id;
 	char label[32];
 	struct memory_stat stat;
 	uint64_t cpucost;
 	uint64_t clock;
+	uint64_t deadline;
+	int deadline_miss;
+	uint64_t runnable;
+	struct histogram *latency;
+	struct profile *profile;
+	atomic_int msg_in;	// external threads post messages too
+	unsigned int msg_out;
+	unsigned int blocked;
+	int live_index;	// in service_pool.live
+	int watchdog;	// SERVICE_WATCHDOG_*
+	atomic_u64 *alarm;	// of the worker running it, set by watchdog
+	uint64_t resume_time;	// the resume *alarm refers to
 };
 
 struct service_pool {
 	int mask;
 	int queue_length;
+	int histogram;
+	int watchdog;
 	unsigned int id;
+	// service_new (scheduler) and service_delete (scheduler or root) change it, service_metrics reads it
+	struct spinlock live_lock;
+	atomic_int live_n;
+	unsigned int *live;	// ids of the live services, for service_metrics
 	struct service **s;
 };
 
@@ -80,9 +104,24 @@ service_create(struct ltask_config *config) {
 	tmp.mask = config->max_service - 1;
 	tmp.id = 0;
 	tmp.queue_length = config->queue;
+	tmp.histogram = config->histogram;
+	tmp.watchdog = SERVICE_WATCHDOG_NONE;
+	if (config->watchdog > 0)
+		tmp.watchdog = config->watchdog_preempt ? SERVICE_WATCHDOG_PREEMPT : SERVICE_WATCHDOG_REPORT;
 	tmp.s = (struct service **)malloc(sizeof(struct service *) * config->max_service);
 	if (tmp.s == NULL)
 		return NULL;
+	atomic_int_init(&tmp.live_n, 0);
+	tmp.live = (unsigned int *)malloc(sizeof(unsigned int) * config->max_service);
+	if (tmp.live == NULL) {
+		free(tmp.s);
+		return NULL;
+	}
+	if (spinlock_init(&tmp.live_lock)) {
+		free(tmp.live);
+		free(tmp.s);
+		return NULL;
+	}
 	struct service_pool * r = (struct service_pool *)malloc(sizeof(tmp));
 	*r = tmp;
 	int i;
@@ -109,6 +148,8 @@ free_service(struct service *S) {
 	}
 	message_delete(S->out);
 	message_delete(S->bounce);
+	free(S->latency);
+	profile_delete(S->profile);
 	free(S);
 }
 
@@ -124,6 +165,8 @@ service_destroy(struct service_pool *p) {
 		}
 	}
 	free(p->s);
+	free(p->live);
+	spinlock_destroy(&p->live_lock);
 	free(p);
 }
 
@@ -180,10 +223,34 @@ service_new(struct service_pool *p, unsigned int sid) {
 	s->id.id = id;
 	s->status = SERVICE_STATUS_UNINITIALIZED;
 	s->binding_thread = -1;
+	s->last_worker = -1;
+	s->group = 0;
 	s->sockevent_id = -1;
 	s->cpucost = 0;
 	s->clock = 0;
+	s->deadline = 0;
+	s->deadline_miss = 0;
+	s->runnable = 0;
+	s->latency = NULL;
+	s->profile = NULL;
+	atomic_int_init(&s->msg_in, 0);
+	s->msg_out = 0;
+	s->blocked = 0;
+	s->watchdog = p->watchdog;
+	s->alarm = NULL;
+	s->resume_time = 0;
+	if (p->histogram) {
+		s->latency = (struct histogram *)malloc(sizeof(struct histogram));
+		if (s->latency)
+			histogram_init(s->latency);
+	}
+	spinlock_acquire(&p->live_lock);
 	*service_slot(p, id) = s;
+	int n = atomic_int_load(&p->live_n);
+	s->live_index = n;
+	p->live[n] = id;
+	atomic_int_store(&p->live_n, n + 1);
+	spinlock_release(&p->live_lock);
 	result.id = id;
 	return result;
 }
@@ -263,6 +330,8 @@ error_message(lua_State *fromL, lua_State *toL, const char *msg) {
 	}
 }
 
+static void set_default_hook(struct service *S, lua_State *L);
+
 int
 service_init(struct service_pool *p, service_id id, void *ud, size_t sz, void *pL) {
 	struct service *S = get_service(p, id);
@@ -276,6 +345,8 @@ service_init(struct service_pool *p, service_id id, void *ud, size_t sz, void *p
 #endif
 	if (L == NULL)
 		return 1;
+	// before any coroutine created, so they inherit the hook
+	set_default_hook(S, L);
 	lua_pushcfunction(L, init_service);
 	lua_pushlightuserdata(L, ud);
 	lua_pushinteger(L, sz);
@@ -362,6 +433,15 @@ service_getlabel(struct service_pool *p, service_id id) {
 	return S->label;
 }
 
+void
+service_copylabel(struct service_pool *p, service_id id, char *label, size_t sz) {
+	spinlock_acquire(&p->live_lock);
+	const char *src = service_getlabel(p, id);
+	strncpy(label, src, sz-1);
+	label[sz-1] = '\0';
+	spinlock_release(&p->live_lock);
+}
+
 void 
 service_close(struct service_pool *p, service_id id) {
 	struct service * s = get_service(p, id);
@@ -378,7 +458,16 @@ void
 service_delete(struct service_pool *p, service_id id) {
 	struct service * s = get_service(p, id);
 	if (s) {
+		// removed from live before freed, so service_metrics never sees a freed one
+		spinlock_acquire(&p->live_lock);
 		*service_slot(p, id.id) = NULL;
+		int n = atomic_int_load(&p->live_n) - 1;
+		unsigned int last = p->live[n];
+		p->live[s->live_index] = last;
+		if (last != id.id)
+			(*service_slot(p, last))->live_index = s->live_index;
+		atomic_int_store(&p->live_n, n);
+		spinlock_release(&p->live_lock);
 		free_service(s);
 	}
 }
@@ -443,6 +532,7 @@ service_push_message(struct service_pool *p, service_id id, struct message *msg)
 		// blocked
 		return 1;
 	}
+	atomic_int_inc(&s->msg_in);
 	return 0;
 }
 
@@ -485,6 +575,12 @@ service_send_message(struct service_pool *p, service_id id, struct message *msg)
 void
 service_write_receipt(struct service_pool *p, service_id id, int receipt, struct message *bounce) {
 	struct service *s = get_service(p, id);
+	if (s != NULL) {
+		if (receipt == MESSAGE_RECEIPT_DONE)
+			++s->msg_out;
+		else if (receipt == MESSAGE_RECEIPT_BLOCK)
+			++s->blocked;
+	}
 	if (s != NULL && s->receipt == MESSAGE_RECEIPT_NONE) {
 		s->receipt = receipt;
 		s->bounce = bounce;
@@ -550,6 +646,8 @@ service_send_signal(struct service_pool *p, service_id id) {
 	msg.type = MESSAGE_SIGNAL;
 	msg.msg = NULL;
 	msg.sz = 0;
+	msg.trace = 0;
+	msg.span = 0;
 
 	s->out = message_new(&msg);
 }
@@ -614,12 +712,8 @@ find_running(lua_State *L) {
 	return L;
 }
 
-int
-service_backtrace(struct service_pool *p, service_id id, char *buf, size_t sz) {
-	struct service *S= get_service(p, id);
-	if (S == NULL)
-		return 0;
-	lua_State *L = find_running(S->L);
+static int
+backtrace(lua_State *L, char *buf, size_t sz) {
 	struct strbuff b = { buf, sz };
 	int level = 0;
 	lua_Debug ar;
@@ -650,6 +744,176 @@ service_backtrace(struct service_pool *p, service_id id, char *buf, size_t sz) {
 	return (int)(sz - b.sz);
 }
 
+int
+service_backtrace(struct service_pool *p, service_id id, char *buf, size_t sz) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return 0;
+	return backtrace(find_running(S->L), buf, sz);
+}
+
+// Sampling profiler : a count hook takes a sample (walks the stack) every interval of cpu time.
+// The coroutines created by a hooked thread inherit the hook (lua_newthread).
+
+#define HOOK_COUNT 1000
+#define PROFILE_MASK LUA_MASKCOUNT
+#define PROFILE_DEPTH 64
+#define PROFILE_STACK 4096
+
+static size_t
+frame_name(lua_State *L, lua_Debug *ar, char *buf, size_t sz) {
+	lua_getinfo(L, "Sn", ar);
+	int n;
+	if (*ar->what == 'C') {
+		n = snprintf(buf, sz, "%s [C]", ar->name ? ar->name : "?");
+	} else if (*ar->what == 'm') {
+		n = snprintf(buf, sz, "main chunk %s", ar->short_src);
+	} else {
+		n = snprintf(buf, sz, "%s %s:%d", ar->name ? ar->name : "?", ar->short_src, ar->linedefined);
+	}
+	if (n < 0)
+		return 0;
+	if ((size_t)n >= sz)
+		n = (int)sz - 1;
+	size_t i;
+	for (i=0;i<(size_t)n;i++) {
+		// ';' splits the frames of folded stack
+		if (buf[i] == ';')
+			buf[i] = ':';
+	}
+	return n;
+}
+
+static void
+profile_sample(lua_State *L, struct profile *P) {
+	lua_Debug ar[PROFILE_DEPTH];
+	int depth = 0;
+	while (depth < PROFILE_DEPTH && lua_getstack(L, depth, &ar[depth]))
+		++depth;
+	char stack[PROFILE_STACK];
+	size_t sz = 0;
+	int i;
+	for (i=depth-1;i>=0;i--) {
+		if (sz + 2 >= sizeof(stack))
+			break;
+		if (sz > 0)
+			stack[sz++] = ';';
+		sz += frame_name(L, &ar[i], stack + sz, sizeof(stack) - sz);
+	}
+	if (sz > 0)
+		profile_add(P, stack, sz);
+}
+
+static void
+watchdog_alarm(lua_State *L, struct service *S) {
+	atomic_u64_store(S->alarm, 0);
+	char buf[4096];
+	int n = backtrace(L, buf, sizeof(buf));
+	fprintf(stderr, "WATCHDOG: service %x (%s) runs too long\n%.*s", S->id.id, S->label, n, buf);
+	fflush(stderr);
+	if (S->watchdog == SERVICE_WATCHDOG_PREEMPT) {
+		luaL_error(L, "Service %s is preempted by watchdog", S->label);
+	}
+}
+
+static void service_hook(lua_State *L, lua_Debug *ar);
+
+// a count hook for watchdog, or none
+static void
+set_default_hook(struct service *S, lua_State *L) {
+	if (S->watchdog != SERVICE_WATCHDOG_NONE) {
+		lua_sethook(L, service_hook, LUA_MASKCOUNT, HOOK_COUNT);
+	} else {
+		lua_sethook(L, NULL, 0, 0);
+	}
+}
+
+static void
+service_hook(lua_State *L, lua_Debug *ar) {
+	void *ud;
+	lua_getallocf(L, &ud);
+	struct service *S = (struct service *)((char *)ud - offsetof(struct service, stat));
+	if (ar->event == LUA_HOOKCOUNT && S->alarm && atomic_u64_load(S->alarm) == S->resume_time) {
+		watchdog_alarm(L, S);
+	}
+	struct profile *P = S->profile;
+	if (P == NULL || !profile_active(P)) {
+		// profiler stopped
+		if (lua_gethookmask(L) != LUA_MASKCOUNT || S->watchdog == SERVICE_WATCHDOG_NONE)
+			set_default_hook(S, L);
+		return;
+	}
+	if (profile_tick(P, systime_thread()))
+		profile_sample(L, P);
+}
+
+int
+service_profile(struct service_pool *p, service_id id, lua_State *co, uint64_t interval) {
+	struct service *S= get_service(p, id);
+	if (S == NULL || S->L == NULL)
+		return 1;
+	if (S->profile == NULL) {
+		if (interval == 0)
+			return 0;
+		S->profile = profile_new();
+		if (S->profile == NULL)
+			return 1;
+	}
+	profile_interval(S->profile, interval);
+	if (interval) {
+		lua_sethook(S->L, service_hook, PROFILE_MASK, HOOK_COUNT);
+		if (co != S->L)
+			lua_sethook(co, service_hook, PROFILE_MASK, HOOK_COUNT);
+	} else {
+		// the hooks of coroutines reset themselves later
+		set_default_hook(S, S->L);
+	}
+	return 0;
+}
+
+struct profile *
+service_profile_get(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return NULL;
+	return S->profile;
+}
+
+void
+service_watchdog_watch(struct service_pool *p, service_id id, atomic_u64 *alarm, uint64_t resume_time) {
+	struct service *S= get_service(p, id);
+	if (S == NULL || S->watchdog == SERVICE_WATCHDOG_NONE)
+		return;
+	S->alarm = alarm;
+	S->resume_time = resume_time;
+}
+
+int
+service_count(struct service_pool *p) {
+	return atomic_int_load(&p->live_n);
+}
+
+int
+service_metrics(struct service_pool *p, struct service_metrics *m, int n) {
+	spinlock_acquire(&p->live_lock);
+	int live_n = atomic_int_load(&p->live_n);
+	int i;
+	int count = 0;
+	for (i=0;i<live_n && count<n;i++) {
+		struct service *S = *service_slot(p, p->live[i]);
+		if (S == NULL)
+			continue;
+		m[count].id = S->id;
+		m[count].mailbox = S->msg ? queue_length(S->msg) : 0;
+		m[count].msg_in = (unsigned int)atomic_int_load(&S->msg_in);
+		m[count].msg_out = S->msg_out;
+		m[count].blocked = S->blocked;
+		++count;
+	}
+	spinlock_release(&p->live_lock);
+	return live_n > n ? live_n : count;
+}
+
 uint64_t
 service_cpucost(struct service_pool *p, service_id id) {
 	struct service *S= get_service(p, id);
@@ -674,6 +938,102 @@ service_binding_set(struct service_pool *p, service_id id, int worker_thread) {
 	S->binding_thread = worker_thread;
 }
 
+int
+service_worker_get(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return -1;
+	return S->last_worker;
+}
+
+void
+service_worker_set(struct service_pool *p, service_id id, int worker_thread) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return;
+	S->last_worker = worker_thread;
+}
+
+uint64_t
+service_deadline_get(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return 0;
+	return S->deadline;
+}
+
+void
+service_deadline_set(struct service_pool *p, service_id id, uint64_t deadline) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return;
+	S->deadline = deadline;
+}
+
+int
+service_deadline_check(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL || S->deadline == 0)
+		return 0;
+	int miss = systime_counter() > S->deadline;
+	S->deadline = 0;
+	S->deadline_miss += miss;
+	return miss;
+}
+
+int
+service_deadline_miss(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return 0;
+	return S->deadline_miss;
+}
+
+void
+service_runnable(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL || S->latency == NULL)
+		return;
+	// schedule_back may push it again before it resumes, keep the first time
+	if (S->runnable == 0)
+		S->runnable = systime_counter();
+}
+
+uint64_t
+service_runnable_latency(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL || S->runnable == 0)
+		return 0;
+	uint64_t t = systime_counter() - S->runnable;
+	S->runnable = 0;
+	histogram_record(S->latency, t);
+	return t;
+}
+
+struct histogram *
+service_histogram(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return NULL;
+	return S->latency;
+}
+
+int
+service_group_get(struct service_pool *p, service_id id) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return 0;
+	return S->group;
+}
+
+void
+service_group_set(struct service_pool *p, service_id id, int group) {
+	struct service *S= get_service(p, id);
+	if (S == NULL)
+		return;
+	S->group = group;
+}
+
 int
 service_sockevent_get(struct service_pool *p, service_id id) {
 	struct service *S= get_service(p, id);
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "atomic.h"
 
 #define LTASK_KEY "LTASK_ID"
 
@@ -20,6 +21,9 @@
 struct service_pool;
 struct ltask_config;
 struct message;
+struct histogram;
+struct profile;
+struct lua_State;
 
 typedef struct {
 	unsigned int id;
@@ -33,6 +37,8 @@ int service_init(struct service_pool *p, service_id id, void *ud, size_t sz, voi
 int service_requiref(struct service_pool *p, service_id id, const char *name, void *f, void *L);
 int service_setlabel(struct service_pool *p, service_id id, const char *label);
 const char * service_getlabel(struct service_pool *p, service_id id);
+// for other threads, the service can't be deleted while copying
+void service_copylabel(struct service_pool *p, service_id id, char *label, size_t sz);
 // 0 succ
 void service_send_signal(struct service_pool *p, service_id id);
 void service_close(struct service_pool *p, service_id id);
@@ -55,8 +61,52 @@ size_t service_memlimit(struct service_pool *p, service_id id, size_t limit);
 size_t service_memcount(struct service_pool *p, service_id id, int luatype);
 int service_backtrace(struct service_pool *p, service_id id, char *buf, size_t sz);
 uint64_t service_cpucost(struct service_pool *p, service_id id);
+// sample the lua stacks every interval of cpu time (systime_thread), 0 : stop. 0 : succ
+// co is the running coroutine, hooked with the main thread. The coroutines created before are not sampled.
+int service_profile(struct service_pool *p, service_id id, struct lua_State *co, uint64_t interval);
+struct profile * service_profile_get(struct service_pool *p, service_id id);
+
+#define SERVICE_WATCHDOG_NONE 0
+#define SERVICE_WATCHDOG_REPORT 1
+#define SERVICE_WATCHDOG_PREEMPT 2
+
+// Called by the worker before resuming the service. When *alarm == resume_time,
+// the count hook reports the backtrace (and raises an error if preempt). alarm NULL : not watched
+void service_watchdog_watch(struct service_pool *p, service_id id, atomic_u64 *alarm, uint64_t resume_time);
+
+struct service_metrics {
+	service_id id;
+	int mailbox;	// messages in queue
+	unsigned int msg_in;
+	unsigned int msg_out;
+	unsigned int blocked;	// blocked receipts
+};
+
+// the number of live services, it may change unless the scheduler is acquired
+int service_count(struct service_pool *p);
+// copy at most n live services into m, returns the number copied, or the number of live services if more than n.
+// It holds the pool's live lock, so services can't be created or deleted while copying
+int service_metrics(struct service_pool *p, struct service_metrics *m, int n);
 int service_binding_get(struct service_pool *p, service_id id);
 void service_binding_set(struct service_pool *p, service_id id, int worker_thread);
+// the worker which ran the service last time, a soft preference for scheduling
+int service_worker_get(struct service_pool *p, service_id id);
+void service_worker_set(struct service_pool *p, service_id id, int worker_thread);
+// deadline in systime_counter, 0 : none
+uint64_t service_deadline_get(struct service_pool *p, service_id id);
+void service_deadline_set(struct service_pool *p, service_id id, uint64_t deadline);
+// clear the deadline when the service resumes, 1 : missed
+int service_deadline_check(struct service_pool *p, service_id id);
+int service_deadline_miss(struct service_pool *p, service_id id);
+// latency histogram (config.histogram) from runnable to resume, in systime_counter
+// service_runnable stamps the first transition to runnable, service_runnable_latency clears it
+void service_runnable(struct service_pool *p, service_id id);
+// 0 : not recorded
+uint64_t service_runnable_latency(struct service_pool *p, service_id id);
+struct histogram * service_histogram(struct service_pool *p, service_id id);
+// the worker group which runs the service, 0 : default
+int service_group_get(struct service_pool *p, service_id id);
+void service_group_set(struct service_pool *p, service_id id, int group);
 int service_sockevent_get(struct service_pool *p, service_id id);
 void service_sockevent_init(struct service_pool *p, service_id id, int index);
 
@@ -1,5 +1,27 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include "sysinfo.h"
 
+#include <stdlib.h>
+
+static int
+cpu_compar(const void *a, const void *b) {
+	const struct sysinfo_cpu *ca = (const struct sysinfo_cpu *)a;
+	const struct sysinfo_cpu *cb = (const struct sysinfo_cpu *)b;
+	if (ca->node != cb->node)
+		return ca->node - cb->node;
+	if (ca->core != cb->core)
+		return ca->core - cb->core;
+	return ca->id - cb->id;
+}
+
+static inline void
+sort_cpu(struct sysinfo_cpu *cpu, int n) {
+	qsort(cpu, n, sizeof(*cpu), cpu_compar);
+}
+
 #if defined(_WIN32)
 
 #include <windows.h>
@@ -10,6 +32,22 @@ sysinfo_ncores() {
 	return GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
 }
 
+int
+sysinfo_topology(struct sysinfo_cpu *cpu, int n) {
+	// No topology on Windows yet, so .pin and .smt = false have no effect and .cpu ignores nodes.
+	// Processor groups (more than 64 cpus) need GetLogicalProcessorInformationEx and SetThreadGroupAffinity.
+	(void)cpu;
+	(void)n;
+	return 0;
+}
+
+int
+sysinfo_bindcpu(int cpu) {
+	if (cpu < 0 || cpu >= (int)sizeof(DWORD_PTR) * 8)
+		return 1;
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) == 0;
+}
+
 #elif defined(__APPLE__)
 
 #include "unistd.h"
@@ -19,13 +57,113 @@ sysinfo_ncores() {
 	return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+int
+sysinfo_topology(struct sysinfo_cpu *cpu, int n) {
+	int ncores = sysinfo_ncores();
+	if (ncores > n)
+		ncores = n;
+	int i;
+	for (i=0;i<ncores;i++) {
+		cpu[i].id = i;
+		cpu[i].core = i;
+		cpu[i].node = 0;
+	}
+	return ncores;
+}
+
+int
+sysinfo_bindcpu(int cpu) {
+	// macOS has no thread affinity
+	(void)cpu;
+	return 1;
+}
+
 #else
 
 #include <sys/sysinfo.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
 
 int
 sysinfo_ncores() {
 	return get_nprocs();
 }
 
-#endif
\ No newline at end of file
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+// -1 : no such file
+static int
+read_int(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	int v;
+	if (fscanf(f, "%d", &v) != 1)
+		v = -1;
+	fclose(f);
+	return v;
+}
+
+static int
+cpu_node(int id) {
+	char path[128];
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", id);
+	DIR *d = opendir(path);
+	if (d == NULL)
+		return 0;
+	int node = 0;
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+			node = atoi(e->d_name + 4);
+			break;
+		}
+	}
+	closedir(d);
+	return node;
+}
+
+int
+sysinfo_topology(struct sysinfo_cpu *cpu, int n) {
+	char path[128];
+	int ncpu = get_nprocs_conf();
+	int i;
+	int count = 0;
+	for (i=0;i<ncpu && count<n;i++) {
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/online", i);
+		if (read_int(path) == 0)
+			continue;	// offline (cpu0 has no online file)
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_id", i);
+		int core = read_int(path);
+		if (core < 0)
+			return 0;	// no sysfs
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id", i);
+		int package = read_int(path);
+		if (package < 0)
+			package = 0;
+		cpu[count].id = i;
+		// core_id is unique only in a package
+		cpu[count].core = package * 65536 + core;
+		cpu[count].node = cpu_node(i);
+		++count;
+	}
+	sort_cpu(cpu, count);
+	return count;
+}
+
+int
+sysinfo_bindcpu(int cpu) {
+#if defined(__EMSCRIPTEN__)
+	(void)cpu;
+	return 1;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) != 0;
+#endif
+}
+
+#endif
@@ -1,6 +1,16 @@
 #ifndef ltask_sysinfo_h
 #define ltask_sysinfo_h
 
+struct sysinfo_cpu {
+	int id;
+	int core;	// cpus with the same core are SMT siblings
+	int node;	// NUMA node
+};
+
 int sysinfo_ncores();
+// online cpus sorted by (node, core, id), returns the number of cpus, 0 if unknown
+int sysinfo_topology(struct sysinfo_cpu *cpu, int n);
+// bind the current thread to a cpu, 0 succ
+int sysinfo_bindcpu(int cpu);
 
 #endif
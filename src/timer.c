@@ -1,4 +1,5 @@
 #include "spinlock.h"
+#include "atomic.h"
 #include "systime.h"
 #include "timer.h"
 
@@ -14,43 +15,119 @@
 #define TIME_LEVEL (1 << TIME_LEVEL_SHIFT)
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
+#define TIMER_RING 1024
+#define TIMER_ARG_N (TIMER_ARG_SIZE / sizeof(uint64_t))
 
+#define TIMER_HASH 1024
+
+// decision of a cancel in the ring, see timer_cancel
+#define CANCEL_UNDECIDED 0
+#define CANCEL_APPLY 1
+#define CANCEL_LATE 2
+
+// handle : expire (32bits) | seq | ring index (ring_bits), never 0
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev;
+	struct timer_node *hnext;	// in the handle table
+	uint64_t handle;
 	uint32_t expire;
+	uint64_t arg[TIMER_ARG_N];
+};
+
+struct timer_pending {
+	uint64_t handle;
+	int cancel;
+	uint64_t arg[TIMER_ARG_N];
 };
 
+// single producer (a worker), the ticking thread consumes it
+struct timer_ring {
+	atomic_int head;
+	atomic_int tail;
+	uint32_t seq;	// owned by the producer
+	struct timer_pending slot[TIMER_RING];
+	atomic_int decide[TIMER_RING];	// of the cancels
+};
+
+// for the full rings and the threads without a ring, protected by lock
+struct timer_shared {
+	struct spinlock lock;
+	atomic_int n;
+	int cap;
+	uint32_t seq;
+	struct timer_pending *slot;
+};
+
+struct timer_deferred {
+	uint64_t handle;
+	uint32_t gen;
+};
+
+// circular, head is the sentinel
 struct link_list {
 	struct timer_node head;
-	struct timer_node *tail;
 };
 
+// Only the ticking thread (timer_update) touches the wheels, the handle table and the node pool.
 struct timer {
 	struct link_list n[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
-	struct spinlock lock;
+	struct timer_node *freelist;
+	struct timer_node **hash;
+	int hash_size;
+	int hash_n;
+	int deferred_n;	// cancelled before the timer is merged
+	int deferred_cap;
+	uint32_t gen;	// merge_all count
+	struct timer_deferred *deferred;
+	struct timer_shared shared;
+	atomic_int now;	// the time timer_update runs to, see timer_cancel
 	uint32_t time;
 	uint32_t starttime;
 	uint64_t current;
 	uint64_t current_point;
-	timer_execute_func func;
-	void *ud;
+	int rings;
+	int ring_bits;
+	struct timer_ring *r;
 };
 
+static inline void
+link_init(struct link_list *list) {
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+}
+
+static inline int
+link_empty(struct link_list *list) {
+	return list->head.next == &list->head;
+}
+
+// returns a NULL terminated list
 static inline struct timer_node *
 link_clear(struct link_list *list) {
+	if (link_empty(list))
+		return NULL;
 	struct timer_node * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	list->head.prev->next = NULL;
+	link_init(list);
 
 	return ret;
 }
 
 static inline void
 link(struct link_list *list,struct timer_node *node) {
-	list->tail->next = node;
-	list->tail = node;
-	node->next=0;
+	struct timer_node *head = &list->head;
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+static inline void
+unlink_node(struct timer_node *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
 }
 
 static void
@@ -74,17 +151,307 @@ add_node(struct timer *T,struct timer_node *node) {
 	}
 }
 
-void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
+static inline uint64_t
+make_handle(struct timer *T, uint32_t expire, uint32_t seq, int index) {
+	uint32_t id = seq << T->ring_bits | (uint32_t)index;
+	return (uint64_t)expire << 32 | id;
+}
+
+static inline uint32_t
+handle_expire(uint64_t handle) {
+	return (uint32_t)(handle >> 32);
+}
+
+static inline int
+expired(struct timer *T, uint64_t handle) {
+	uint32_t now = (uint32_t)atomic_int_load(&T->now);
+	return (int32_t)(handle_expire(handle) - now) <= 0;
+}
+
+// The producer and the consumer (merge_all) both try to decide the cancel in the ring,
+// the first one wins, so the consumer never waits for a preempted producer.
+static int
+decide_cancel(atomic_int *d, int decide) {
+	for (;;) {
+		if (atomic_int_cas(d, CANCEL_UNDECIDED, decide))
+			return decide;
+		int r = atomic_int_load(d);
+		if (r != CANCEL_UNDECIDED)
+			return r;
+		// spurious failure of weak cas
+	}
+}
+
+// 0 : succ, the cancel is decided with lock, so merge_all never sees the late one.
+static int
+shared_push(struct timer *T, struct timer_pending *p, uint32_t expire) {
+	struct timer_shared *s = &T->shared;
+	spinlock_acquire(&s->lock);
+	if (p->cancel && expired(T, p->handle)) {
+		spinlock_release(&s->lock);
+		return 1;
+	}
+	int n = atomic_int_load(&s->n);
+	if (n >= s->cap) {
+		int cap = s->cap ? s->cap * 2 : TIMER_RING;
+		struct timer_pending *slot = (struct timer_pending *)realloc(s->slot, cap * sizeof(*slot));
+		if (slot == NULL) {
+			spinlock_release(&s->lock);
+			return 1;
+		}
+		s->slot = slot;
+		s->cap = cap;
+	}
+	if (!p->cancel)
+		p->handle = make_handle(T, expire, s->seq++, T->rings + 1);
+	s->slot[n] = *p;
+	atomic_int_store(&s->n, n + 1);
+	spinlock_release(&s->lock);
+	return 0;
+}
+
+// 0 : succ
+static int
+push_pending(struct timer *T, int ring, struct timer_pending *p, uint32_t expire) {
+	if (ring >= 0 && ring < T->rings) {
+		struct timer_ring *r = &T->r[ring];
+		unsigned int tail = (unsigned int)atomic_int_load(&r->tail);
+		if (tail - (unsigned int)atomic_int_load(&r->head) < TIMER_RING) {
+			unsigned int idx = tail % TIMER_RING;
+			if (p->cancel) {
+				atomic_int_store(&r->decide[idx], CANCEL_UNDECIDED);
+			} else {
+				p->handle = make_handle(T, expire, r->seq++, ring + 1);
+			}
+			r->slot[idx] = *p;
+			atomic_int_store(&r->tail, (int)(tail + 1));
+			if (p->cancel) {
+				int decide = decide_cancel(&r->decide[idx], expired(T, p->handle) ? CANCEL_LATE : CANCEL_APPLY);
+				return decide == CANCEL_LATE;
+			}
+			return 0;
+		}
+	}
+	return shared_push(T, p, expire);
+}
+
+uint64_t
+timer_add(struct timer *T, int ring, void *arg, size_t sz, int time) {
+	if (sz > TIMER_ARG_SIZE)
+		return 0;
+	struct timer_pending p;
+	p.cancel = 0;
+	memcpy(p.arg, arg, sz);
+	uint32_t expire = (uint32_t)time + (uint32_t)atomic_int_load(&T->now);
+	if (push_pending(T, ring, &p, expire))
+		return 0;
+	return p.handle;
+}
+
+// timer_update stores T->now before merging the pending timers, and the cancel is pushed before loading T->now.
+// So if T->now hasn't reached the expire time, timer_update sees the cancel before the timer expires.
+// Otherwise the cancel is marked late and ignored by merge_all, so the result is exact.
+// If merge_all meets the cancel before the producer decides, it decides by the time it runs to.
+int
+timer_cancel(struct timer *T, int ring, uint64_t handle) {
+	struct timer_pending p;
+	p.handle = handle;
+	p.cancel = 1;
+	return push_pending(T, ring, &p, 0);
+}
+
+static inline unsigned int
+hash_index(uint64_t handle, int size) {
+	uint32_t h = (uint32_t)handle ^ (uint32_t)(handle >> 32) * 0x9e3779b1u;
+	return h & (size - 1);
+}
+
+static void
+hash_insert(struct timer *T, struct timer_node *node) {
+	if (T->hash_n >= T->hash_size) {
+		int size = T->hash_size * 2;
+		struct timer_node **hash = (struct timer_node **)malloc(size * sizeof(*hash));
+		if (hash) {
+			memset(hash, 0, size * sizeof(*hash));
+			int i;
+			for (i=0;i<T->hash_size;i++) {
+				struct timer_node *n = T->hash[i];
+				while (n) {
+					struct timer_node *next = n->hnext;
+					unsigned int idx = hash_index(n->handle, size);
+					n->hnext = hash[idx];
+					hash[idx] = n;
+					n = next;
+				}
+			}
+			free(T->hash);
+			T->hash = hash;
+			T->hash_size = size;
+		}
+	}
+	unsigned int idx = hash_index(node->handle, T->hash_size);
+	node->hnext = T->hash[idx];
+	T->hash[idx] = node;
+	++T->hash_n;
+}
 
-	spinlock_acquire(&T->lock);
+static struct timer_node *
+hash_remove(struct timer *T, uint64_t handle) {
+	struct timer_node **p = &T->hash[hash_index(handle, T->hash_size)];
+	while (*p) {
+		struct timer_node *n = *p;
+		if (n->handle == handle) {
+			*p = n->hnext;
+			--T->hash_n;
+			return n;
+		}
+		p = &n->hnext;
+	}
+	return NULL;
+}
 
-		node->expire=time+T->time;
-		add_node(T,node);
+// 0 : succ
+static int
+deferred_add(struct timer *T, uint64_t handle) {
+	if (T->deferred_n >= T->deferred_cap) {
+		int cap = T->deferred_cap ? T->deferred_cap * 2 : 16;
+		struct timer_deferred *d = (struct timer_deferred *)realloc(T->deferred, cap * sizeof(*d));
+		if (d == NULL)
+			return 1;
+		T->deferred = d;
+		T->deferred_cap = cap;
+	}
+	struct timer_deferred *d = &T->deferred[T->deferred_n++];
+	d->handle = handle;
+	d->gen = T->gen;
+	return 0;
+}
+
+// 1 : the timer is cancelled before merged
+static int
+deferred_remove(struct timer *T, uint64_t handle) {
+	int i;
+	for (i=0;i<T->deferred_n;i++) {
+		if (T->deferred[i].handle == handle) {
+			T->deferred[i] = T->deferred[--T->deferred_n];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static struct timer_node *
+node_new(struct timer *T) {
+	struct timer_node *node = T->freelist;
+	if (node) {
+		T->freelist = node->next;
+		return node;
+	}
+	return (struct timer_node *)malloc(sizeof(*node));
+}
+
+static inline void
+node_free(struct timer *T, struct timer_node *node) {
+	node->next = T->freelist;
+	T->freelist = node;
+}
+
+// 0 : succ
+static int
+merge_cancel(struct timer *T, uint64_t handle) {
+	struct timer_node *node = hash_remove(T, handle);
+	if (node) {
+		unlink_node(node);
+		node_free(T, node);
+	} else if ((int32_t)(handle_expire(handle) - T->time) > 0) {
+		// not expired, so timer_add is in another ring and not merged yet
+		return deferred_add(T, handle);
+	}
+	return 0;
+}
+
+// 0 : succ, 1 : out of memory, keep the pending one and retry in the next merge_all
+static int
+merge_pending(struct timer *T, const struct timer_pending *p) {
+	if (p->cancel)
+		return merge_cancel(T, p->handle);
+	if (T->deferred_n > 0 && deferred_remove(T, p->handle))
+		return 0;
+	struct timer_node *node = node_new(T);
+	if (node == NULL)
+		return 1;
+	node->handle = p->handle;
+	node->expire = handle_expire(p->handle);
+	if ((int32_t)(node->expire - T->time) < 0) {
+		// T->time moved on after timer_add
+		node->expire = T->time;
+	}
+	memcpy(node->arg, p->arg, sizeof(node->arg));
+	hash_insert(T, node);
+	add_node(T, node);
+	return 0;
+}
+
+// timer_add happens before timer_cancel, so it's merged in the next merge_all at the latest,
+// unless a merge is kept for out of memory (see merge_all).
+// The cancels deferred by the last merge_all and still unmatched are invalid handles.
+static void
+deferred_expire(struct timer *T) {
+	int i;
+	int n = 0;
+	for (i=0;i<T->deferred_n;i++) {
+		if (T->deferred[i].gen == T->gen)
+			T->deferred[n++] = T->deferred[i];
+	}
+	T->deferred_n = n;
+}
 
-	spinlock_release(&T->lock);
+// move the timers added by timer_add into the wheels
+static void
+merge_all(struct timer *T) {
+	int i;
+	int kept = 0;
+	++T->gen;
+	for (i=0;i<T->rings;i++) {
+		struct timer_ring *r = &T->r[i];
+		unsigned int head = (unsigned int)atomic_int_load(&r->head);
+		unsigned int tail = (unsigned int)atomic_int_load(&r->tail);
+		if (head == tail)
+			continue;
+		for (;head != tail;head++) {
+			unsigned int idx = head % TIMER_RING;
+			const struct timer_pending *p = &r->slot[idx];
+			if (p->cancel) {
+				// T->now is the time this update runs to, so APPLY is in time
+				int decide = decide_cancel(&r->decide[idx], expired(T, p->handle) ? CANCEL_LATE : CANCEL_APPLY);
+				if (decide == CANCEL_LATE)
+					continue;
+			}
+			if (merge_pending(T, p)) {
+				// the rest of the ring waits for the next merge_all, the order is kept
+				kept = 1;
+				break;
+			}
+		}
+		atomic_int_store(&r->head, (int)head);
+	}
+	struct timer_shared *s = &T->shared;
+	if (atomic_int_load(&s->n) > 0) {
+		spinlock_acquire(&s->lock);
+		int n = atomic_int_load(&s->n);
+		for (i=0;i<n;i++) {
+			if (merge_pending(T, &s->slot[i])) {
+				kept = 1;
+				break;
+			}
+		}
+		memmove(s->slot, s->slot + i, (n - i) * sizeof(struct timer_pending));
+		atomic_int_store(&s->n, n - i);
+		spinlock_release(&s->lock);
+	}
+	// A kept timer_add may match a deferred cancel later, so don't expire them
+	if (T->deferred_n > 0 && !kept)
+		deferred_expire(T);
 }
 
 static void
@@ -120,33 +487,41 @@ timer_shift(struct timer *T) {
 	}
 }
 
-static inline void
-dispatch_list(struct timer_node *current, timer_execute_func func, void *ud) {
+// the nodes go back to the pool, returns 1 when func fails
+static inline int
+dispatch_list(struct timer *T, struct timer_node *current, timer_execute_func func, void *ud) {
 	do {
-		func(ud, (void *)(current+1));
+		if (func(ud, (void *)current->arg)) {
+			// keep the rest in the next tick, they are still in the handle table
+			struct link_list *next = &T->n[(T->time + 1) & TIME_NEAR_MASK];
+			while (current) {
+				struct timer_node * temp = current->next;
+				link(next, current);
+				current = temp;
+			}
+			return 1;
+		}
+		hash_remove(T, current->handle);
 		struct timer_node * temp = current;
 		current=current->next;
-		free(temp);	
+		node_free(T, temp);
 	} while (current);
+	return 0;
 }
 
 static inline void
 timer_execute(struct timer *T, timer_execute_func func, void *ud) {
 	int idx = T->time & TIME_NEAR_MASK;
 	
-	while (T->n[idx].head.next) {
+	while (!link_empty(&T->n[idx])) {
 		struct timer_node *current = link_clear(&T->n[idx]);
-		spinlock_release(&T->lock);
-		// dispatch_list don't need lock T
-		dispatch_list(current, func, ud);
-		spinlock_acquire(&T->lock);
+		if (dispatch_list(T, current, func, ud))
+			break;
 	}
 }
 
 static void 
 timer_update_tick(struct timer *T, timer_execute_func func, void *ud) {
-	spinlock_acquire(&T->lock);
-
 	// try to dispatch timeout 0 (rare condition)
 	timer_execute(T, func, ud);
 
@@ -154,64 +529,81 @@ timer_update_tick(struct timer *T, timer_execute_func func, void *ud) {
 	timer_shift(T);
 
 	timer_execute(T, func, ud);
-
-	spinlock_release(&T->lock);
 }
 
 static struct timer *
-timer_new() {
+timer_new(int rings) {
 	struct timer *r=(struct timer *)malloc(sizeof(struct timer));
 	memset(r,0,sizeof(*r));
 
 	int i,j;
 
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->n[i]);
+		link_init(&r->n[i]);
 	}
 
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_clear(&r->t[i][j]);
+			link_init(&r->t[i][j]);
 		}
 	}
 
-	spinlock_init(&r->lock);
+	r->hash_size = TIMER_HASH;
+	r->hash = (struct timer_node **)malloc(TIMER_HASH * sizeof(struct timer_node *));
+	memset(r->hash, 0, TIMER_HASH * sizeof(struct timer_node *));
+
+	spinlock_init(&r->shared.lock);
+	atomic_int_init(&r->shared.n, 0);
+	atomic_int_init(&r->now, 0);
 
 	r->current = 0;
 
+	r->r = (struct timer_ring *)malloc(rings * sizeof(struct timer_ring));
+	if (r->r == NULL)
+		rings = 0;
+	for (i=0;i<rings;i++) {
+		atomic_int_init(&r->r[i].head, 0);
+		atomic_int_init(&r->r[i].tail, 0);
+		r->r[i].seq = 0;
+	}
+	r->rings = rings;
+	// ring index is 1 ~ rings+1 (shared)
+	r->ring_bits = 1;
+	while ((1 << r->ring_bits) <= rings + 1)
+		++r->ring_bits;
+
 	return r;
 }
 
 static void
-timer_release_func(void *ud, void *arg) {
-	// do nothing
-	(void)ud;
-	(void)arg;
+free_list(struct timer_node *current) {
+	while (current) {
+		struct timer_node * temp = current;
+		current = current->next;
+		free(temp);
+	}
 }
 
 void
 timer_destroy(struct timer *T) {
 	if (T == NULL)
 		return;
-	spinlock_acquire(&T->lock);
 
 	int i,j;
 	for (i=0;i<TIME_NEAR;i++) {
-		struct timer_node *current = link_clear(&T->n[i]);
-		if (current) {
-			dispatch_list(current, timer_release_func, NULL);
-		}
+		free_list(link_clear(&T->n[i]));
 	}
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			struct timer_node *current = link_clear(&T->t[i][j]);
-			if (current) {
-				dispatch_list(current, timer_release_func, NULL);
-			}
+			free_list(link_clear(&T->t[i][j]));
 		}
 	}
-	spinlock_release(&T->lock);
-	spinlock_destroy(&T->lock);
+	free_list(T->freelist);
+	free(T->hash);
+	free(T->deferred);
+	spinlock_destroy(&T->shared.lock);
+	free(T->shared.slot);
+	free(T->r);
 
 	free(T);
 }
@@ -226,6 +618,9 @@ timer_update(struct timer *TI, timer_execute_func func, void *ud) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
 		TI->current_point = cp;
 		TI->current += diff;
+		// publish the time before merging, see timer_cancel
+		atomic_int_store(&TI->now, (int)(TI->time + diff));
+		merge_all(TI);
 		int i;
 		for (i=0;i<diff;i++) {
 			timer_update_tick(TI, func, ud);
@@ -244,8 +639,8 @@ timer_now(struct timer *TI) {
 }
 
 struct timer *
-timer_init() {
-	struct timer *TI = timer_new();
+timer_init(int rings) {
+	struct timer *TI = timer_new(rings);
 	uint64_t walltime = systime_wall();
 	TI->starttime = walltime/100;
 	TI->current = walltime % 100;
@@ -2,16 +2,26 @@
 #define ltask_timer_h
 
 #include <stdint.h>
+#include <stddef.h>
+
+// the arg of timer_add is copied, at most TIMER_ARG_SIZE bytes
+#define TIMER_ARG_SIZE 16
 
 struct timer;
 
-typedef void (*timer_execute_func)(void *ud,void *arg);
+// returns 0 : done, otherwise the timer is kept and executed again in the next tick
+typedef int (*timer_execute_func)(void *ud,void *arg);
 
-struct timer * timer_init();
+// a ring for each worker, timer_add from a worker needs no lock nor malloc
+struct timer * timer_init(int rings);
 void timer_destroy(struct timer *T);
 uint64_t timer_now(struct timer *TI);
 uint32_t timer_starttime(struct timer *TI);
+// only one thread (the scheduler owner) calls timer_update at a time
 void timer_update(struct timer *TI, timer_execute_func func, void *ud);
-void timer_add(struct timer *T,void *arg,size_t sz,int time);
+// ring < 0 : no ring of the thread. returns the handle, 0 : failed
+uint64_t timer_add(struct timer *T, int ring, void *arg, size_t sz, int time);
+// 0 : cancelled, the timer will not expire. 1 : it has expired or it's too late to cancel
+int timer_cancel(struct timer *T, int ring, uint64_t handle);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,249 @@
+#include "trace.h"
+#include "atomic.h"
+#include "systime.h"
+#include "service.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// test whether an unsigned value is a power of 2 (or zero)
+#define ispow2(x)	(((x) & ((x) - 1)) == 0)
+
+struct trace_event {
+	uint64_t ts;
+	unsigned int type;
+	unsigned int id;
+	unsigned int arg;
+};
+
+// heads are 64bit counters, they never wrap around
+struct trace_ring {
+	atomic_u64 head;
+	struct trace_event *e;
+};
+
+struct trace_span {
+	uint64_t start;
+	uint64_t finish;
+	unsigned int trace;
+	unsigned int span;
+	unsigned int parent;
+	unsigned int service;
+};
+
+struct trace {
+	atomic_int enable;
+	int rings;
+	int size;
+	uint64_t start;
+	atomic_int span_id;
+	atomic_u64 span_head;
+	struct trace_span *span;	// spans of all services share one ring
+	struct trace_ring r[1];
+};
+
+struct trace *
+trace_new(int rings, int size) {
+	if (!ispow2((unsigned)size))
+		return NULL;
+	struct trace *t = (struct trace *)malloc(sizeof(*t) + (rings - 1) * sizeof(struct trace_ring));
+	if (t == NULL)
+		return NULL;
+	atomic_int_init(&t->enable, 0);
+	t->rings = rings;
+	t->size = size;
+	t->start = systime_counter();
+	atomic_int_init(&t->span_id, 0);
+	atomic_u64_init(&t->span_head, 0);
+	t->span = (struct trace_span *)calloc(size, sizeof(struct trace_span));
+	if (t->span == NULL) {
+		free(t);
+		return NULL;
+	}
+	int i;
+	for (i=0;i<rings;i++) {
+		atomic_u64_init(&t->r[i].head, 0);
+		t->r[i].e = (struct trace_event *)calloc(size, sizeof(struct trace_event));
+		if (t->r[i].e == NULL) {
+			t->rings = i;
+			trace_delete(t);
+			return NULL;
+		}
+	}
+	return t;
+}
+
+void
+trace_delete(struct trace *t) {
+	if (t == NULL)
+		return;
+	int i;
+	for (i=0;i<t->rings;i++) {
+		free(t->r[i].e);
+	}
+	free(t->span);
+	free(t);
+}
+
+void
+trace_enable(struct trace *t, int enable) {
+	atomic_int_store(&t->enable, enable);
+}
+
+int
+trace_enabled(struct trace *t) {
+	return atomic_int_load(&t->enable);
+}
+
+void
+trace_record(struct trace *t, int ring, int type, unsigned int id, unsigned int arg) {
+	if (!atomic_int_load(&t->enable) || ring < 0 || ring >= t->rings)
+		return;
+	struct trace_ring *r = &t->r[ring];
+	// usually only one producer for each ring, but it's cheap to be safe
+	uint64_t index = atomic_u64_add(&r->head, 1);
+	struct trace_event *e = &r->e[index & (t->size - 1)];
+	e->ts = systime_counter();
+	e->type = type;
+	e->id = id;
+	e->arg = arg;
+}
+
+unsigned int
+trace_span_new(struct trace *t) {
+	unsigned int id;
+	do {
+		id = (unsigned int)atomic_int_inc(&t->span_id);
+	} while (id == 0);
+	return id;
+}
+
+void
+trace_span_record(struct trace *t, unsigned int trace, unsigned int span, unsigned int parent, unsigned int service, uint64_t start) {
+	if (!atomic_int_load(&t->enable))
+		return;
+	uint64_t index = atomic_u64_add(&t->span_head, 1);
+	struct trace_span *s = &t->span[index & (t->size - 1)];
+	s->start = start;
+	s->finish = systime_counter();
+	s->trace = trace;
+	s->span = span;
+	s->parent = parent;
+	s->service = service;
+}
+
+// labels are set by services, escape them for json
+static void
+write_label(FILE *f, const char *label) {
+	if (label == NULL)
+		label = "service";
+	for (;*label;label++) {
+		unsigned char c = (unsigned char)*label;
+		if (c == '"' || c == '\\') {
+			fputc('\\', f);
+			fputc(c, f);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+}
+
+static int
+write_spans(FILE *f, struct trace *t, double freq, struct service_pool *P) {
+	uint64_t head = atomic_u64_load(&t->span_head);
+	int n = head < (uint64_t)t->size ? (int)head : t->size;
+	int count = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		struct trace_span s = t->span[(head - n + i) & (t->size - 1)];
+		if (s.start < t->start)	// empty slot
+			continue;
+		double ts = (double)(s.start - t->start) * 1000000.0 / freq;
+		double dur = (double)(s.finish - s.start) * 1000000.0 / freq;
+		service_id id = { s.service };
+		char label[32];
+		service_copylabel(P, id, label, sizeof(label));
+		fprintf(f, "{\"name\":\"");
+		write_label(f, label);
+		fprintf(f, "\",\"cat\":\"span\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+			"\"args\":{\"trace\":%u,\"span\":%u,\"parent\":%u}},\n",
+			ts, dur, s.service, s.trace, s.span, s.parent);
+		++count;
+	}
+	return count;
+}
+
+static void
+write_event(FILE *f, struct trace *t, int ring, const struct trace_event *e, double freq, struct service_pool *P) {
+	double ts = (double)(e->ts - t->start) * 1000000.0 / freq;
+	switch (e->type) {
+	case TRACE_RESUME:
+	case TRACE_YIELD: {
+		service_id id = { e->id };
+		char label[32];
+		service_copylabel(P, id, label, sizeof(label));
+		fprintf(f, "{\"name\":\"");
+		write_label(f, label);
+		fprintf(f, ":%x\",\"cat\":\"service\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%d},\n",
+			e->id, e->type == TRACE_RESUME ? "B" : "E", ts, ring);
+		break; }
+	case TRACE_SEND:
+		fprintf(f, "{\"name\":\"send\",\"cat\":\"message\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"from\":%u,\"to\":%u}},\n",
+			ts, ring, e->id, e->arg);
+		break;
+	case TRACE_RECV:
+		fprintf(f, "{\"name\":\"recv\",\"cat\":\"message\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"service\":%u,\"from\":%u}},\n",
+			ts, ring, e->id, e->arg);
+		break;
+	case TRACE_SCHEDULE_ACQUIRE:
+	case TRACE_SCHEDULE_RELEASE:
+		fprintf(f, "{\"name\":\"schedule\",\"cat\":\"scheduler\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%d},\n",
+			e->type == TRACE_SCHEDULE_ACQUIRE ? "B" : "E", ts, ring);
+		break;
+	case TRACE_SLEEP:
+	case TRACE_WAKEUP:
+		fprintf(f, "{\"name\":\"sleep\",\"cat\":\"worker\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%d},\n",
+			e->type == TRACE_SLEEP ? "B" : "E", ts, ring);
+		break;
+	}
+}
+
+int
+trace_dump(struct trace *t, FILE *f, struct service_pool *P) {
+	double freq = (double)systime_frequency();
+	struct trace_event *tmp = (struct trace_event *)malloc(t->size * sizeof(struct trace_event));
+	if (tmp == NULL)
+		return -1;
+	int count = 0;
+	int i, j;
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (i=0;i<t->rings;i++) {
+		struct trace_ring *r = &t->r[i];
+		uint64_t head = atomic_u64_load(&r->head);
+		int n = head < (uint64_t)t->size ? (int)head : t->size;
+		for (j=0;j<n;j++) {
+			tmp[j] = r->e[(head - n + j) & (t->size - 1)];
+		}
+		// drop the events overwritten while copying
+		uint64_t overwritten = atomic_u64_load(&r->head) - head;
+		int skip = overwritten > (uint64_t)n ? n : (int)overwritten;
+		if (n > 0) {
+			if (i == t->rings - 1) {
+				fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"mainthread\"}},\n", i);
+			} else {
+				fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"worker-%d\"}},\n", i, i);
+			}
+		}
+		for (j=skip;j<n;j++) {
+			write_event(f, t, i, &tmp[j], freq, P);
+			++count;
+		}
+	}
+	count += write_spans(f, t, freq, P);
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"spans\"}},\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"workers\"}}\n]}\n");
+	free(tmp);
+	return count;
+}
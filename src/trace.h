@@ -0,0 +1,32 @@
+#ifndef ltask_trace_h
+#define ltask_trace_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TRACE_RESUME 1	// id : service
+#define TRACE_YIELD 2	// id : service
+#define TRACE_SEND 3	// id : from, arg : to
+#define TRACE_RECV 4	// id : service, arg : from
+#define TRACE_SCHEDULE_ACQUIRE 5
+#define TRACE_SCHEDULE_RELEASE 6
+#define TRACE_SLEEP 7
+#define TRACE_WAKEUP 8
+
+struct trace;
+struct service_pool;
+
+// Fixed-size binary events in a ring buffer for each thread, the oldest events are overwritten.
+struct trace * trace_new(int rings, int size);
+void trace_delete(struct trace *t);
+void trace_enable(struct trace *t, int enable);
+int trace_enabled(struct trace *t);
+void trace_record(struct trace *t, int ring, int type, unsigned int id, unsigned int arg);
+// span of a call chain, ids are unique in process, never 0
+unsigned int trace_span_new(struct trace *t);
+// the span ends now, start in systime_counter
+void trace_span_record(struct trace *t, unsigned int trace, unsigned int span, unsigned int parent, unsigned int service, uint64_t start);
+// Write Chrome trace (json), returns the number of events
+int trace_dump(struct trace *t, FILE *f, struct service_pool *P);
+
+#endif
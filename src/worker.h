@@ -2,26 +2,116 @@
 #define ltask_worker_h
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
 
 #include "atomic.h"
 #include "thread.h"
 #include "service.h"
 #include "debuglog.h"
 #include "cond.h"
+#include "futex.h"
 #include "systime.h"
+#include "bitmap.h"
 
 struct ltask;
 
 #define BINDING_SERVICE_QUEUE 16
 
+// Growable FIFO of the services bound to a worker, only the scheduler uses it
 struct binding_service {
 	int head;
 	int tail;
-	service_id q[BINDING_SERVICE_QUEUE];
+	int cap;
+	service_id *q;
 };
 
+static inline int
+binding_queue_empty(struct binding_service *q) {
+	return q->head == q->tail;
+}
+
+// 0 : succ, 1 : out of memory
+static inline int
+binding_queue_push(struct binding_service *q, service_id id) {
+	if (q->tail - q->head >= q->cap) {
+		int cap = q->cap ? q->cap * 2 : BINDING_SERVICE_QUEUE;
+		service_id *nq = (service_id *)malloc(cap * sizeof(service_id));
+		if (nq == NULL)
+			return 1;
+		int n = q->tail - q->head;
+		int i;
+		for (i=0;i<n;i++) {
+			nq[i] = q->q[(q->head + i) % q->cap];
+		}
+		free(q->q);
+		q->q = nq;
+		q->cap = cap;
+		q->head = 0;
+		q->tail = n;
+	}
+	q->q[q->tail % q->cap] = id;
+	++q->tail;
+	return 0;
+}
+
+static inline service_id
+binding_queue_pop(struct binding_service *q) {
+	assert(q->head != q->tail);
+	service_id id = q->q[q->head % q->cap];
+	++q->head;
+	if (q->head >= q->cap) {
+		q->head -= q->cap;
+		q->tail -= q->cap;
+	}
+	return id;
+}
+
+// Written by both the scheduler and workers, so the scheduler can skip workers whose state doesn't change.
+struct worker_state {
+	struct bitmap ready;	// service_ready may be set (Scheduler)
+	struct bitmap queued;	// binding queue is not empty (Scheduler)
+	struct bitmap waiting;	// waiting may be set (Scheduler)
+	struct bitmap busy;	// running a service (Worker)
+	struct bitmap done;	// service_done may be set (Worker)
+};
+
+static inline void
+worker_state_init(struct worker_state *s) {
+	bitmap_init(&s->ready);
+	bitmap_init(&s->queued);
+	bitmap_init(&s->waiting);
+	bitmap_init(&s->busy);
+	bitmap_init(&s->done);
+}
+
+#define WORKER_PARK_NONE 0
+#define WORKER_PARK_NOTIFY 1
+#define WORKER_PARK_SLEEP 2
+
+// Counters written only by the owner thread, the others read them for metrics
+struct worker_metrics {
+	atomic_u64 busy;	// running services, in systime_counter
+	atomic_u64 idle;	// sleeping, in systime_counter
+	atomic_int resume;
+	atomic_int wakeup;
+	atomic_int acquire;	// scheduler acquired
+	atomic_int contention;	// failed to acquire scheduler
+};
+
+static inline void
+worker_metrics_init(struct worker_metrics *m) {
+	atomic_u64_init(&m->busy, 0);
+	atomic_u64_init(&m->idle, 0);
+	atomic_int_init(&m->resume, 0);
+	atomic_int_init(&m->wakeup, 0);
+	atomic_int_init(&m->acquire, 0);
+	atomic_int_init(&m->contention, 0);
+}
+
 struct worker_thread {
 	struct ltask *task;
+	struct worker_state *state;
 #ifdef DEBUGLOG
 	struct debug_logger *logger;
 #endif
@@ -32,33 +122,59 @@ struct worker_thread {
 	atomic_int service_ready;
 	atomic_int service_done;
 	int term_signal;
+	atomic_int retire;	// quit after the current job, set by worker_resize
+	int busy;
+	int spin;	// adaptive spin budget before sleeping
+	atomic_int alive;	// the thread is running
+	void *thread;	// handle of the thread started by worker_resize
+#ifdef FUTEX_SUPPORT
+	atomic_int park;
+#else
 	int sleeping;
 	int wakeup;
-	int busy;
 	struct cond trigger;
+#endif
 	struct binding_service binding_queue;
+	struct worker_metrics metrics;
+	atomic_u64 resume_time;	// the running service resumed at, 0 : none. for watchdog
+	atomic_int resume_id;
+	atomic_u64 alarm;	// resume_time alarmed by watchdog, only matches the same resume
 	uint64_t schedule_time;
 };
 
 static inline void
-worker_init(struct worker_thread *worker, struct ltask *task, int worker_id) {
+worker_init(struct worker_thread *worker, struct ltask *task, struct worker_state *state, int worker_id) {
 	worker->task = task;
+	worker->state = state;
 #ifdef DEBUGLOG
 	worker->logger = dlog_new("WORKER", worker_id);
 #endif
 	worker->worker_id = worker_id;
 	atomic_int_init(&worker->service_ready, 0);
 	atomic_int_init(&worker->service_done, 0);
+#ifdef FUTEX_SUPPORT
+	atomic_int_init(&worker->park, WORKER_PARK_NONE);
+#else
 	cond_create(&worker->trigger);
+	worker->sleeping = 0;
+	worker->wakeup = 0;
+#endif
 	worker->running.id = 0;
 	worker->binding.id = 0;
 	worker->waiting.id = 0;
 	worker->term_signal = 0;
-	worker->sleeping = 0;
-	worker->wakeup = 0;
+	atomic_int_init(&worker->retire, 0);
 	worker->busy = 0;
+	atomic_int_init(&worker->alive, 0);
+	worker->thread = NULL;
 	worker->binding_queue.head = 0;
 	worker->binding_queue.tail = 0;
+	worker->binding_queue.cap = 0;
+	worker->binding_queue.q = NULL;
+	worker_metrics_init(&worker->metrics);
+	atomic_u64_init(&worker->resume_time, 0);
+	atomic_int_init(&worker->resume_id, 0);
+	atomic_u64_init(&worker->alarm, 0);
 }
 
 static inline int
@@ -66,6 +182,46 @@ worker_has_job(struct worker_thread *worker) {
 	return worker->service_ready != 0;
 }
 
+#ifdef FUTEX_SUPPORT
+
+// An eventcount on worker->park : wakeup costs a syscall only when the worker is sleeping
+
+static inline void
+worker_sleep(struct worker_thread *w) {
+	if (w->term_signal)
+		return;
+	if (!worker_has_job(w) && atomic_int_cas(&w->park, WORKER_PARK_NONE, WORKER_PARK_SLEEP)) {
+		// check again after announcing sleep, worker_wakeup may miss it
+		if (!worker_has_job(w) && !w->term_signal) {
+			while (atomic_int_load(&w->park) == WORKER_PARK_SLEEP) {
+				futex_wait(&w->park, WORKER_PARK_SLEEP);
+			}
+		}
+	}
+	// consume the notification
+	atomic_int_store(&w->park, WORKER_PARK_NONE);
+}
+
+static inline int
+worker_wakeup(struct worker_thread *w) {
+	int sleeping = atomic_int_exchange(&w->park, WORKER_PARK_NOTIFY) == WORKER_PARK_SLEEP;
+	if (sleeping)
+		futex_wake(&w->park, 1);
+	return sleeping;
+}
+
+static inline void
+worker_quit(struct worker_thread *w) {
+	atomic_int_store(&w->park, WORKER_PARK_NONE);
+}
+
+static inline void
+worker_destroy(struct worker_thread *worker) {
+	free(worker->binding_queue.q);
+}
+
+#else
+
 static inline void
 worker_sleep(struct worker_thread *w) {
 	if (w->term_signal)
@@ -105,17 +261,17 @@ worker_quit(struct worker_thread *w) {
 static inline void
 worker_destroy(struct worker_thread *worker) {
 	cond_release(&worker->trigger);
+	free(worker->binding_queue.q);
 }
 
+#endif
+
 // Calling by Scheduler. 0 : succ
 static inline int
 worker_binding_job(struct worker_thread *worker, service_id id) {
-	struct binding_service * q = &(worker->binding_queue);
-	if (q->tail - q->head >= BINDING_SERVICE_QUEUE)	// queue full
+	if (binding_queue_push(&worker->binding_queue, id))
 		return 1;
-	q->q[q->tail % BINDING_SERVICE_QUEUE] = id;
-	++q->tail;
-	assert(q->tail > 0);
+	bitmap_set(&worker->state->queued, worker->worker_id);
 	return 0;
 }
 
@@ -125,14 +281,15 @@ worker_assign_job(struct worker_thread *worker, service_id id) {
 	if (worker->service_ready == 0) {
 		// try binding queue itself
 		struct binding_service * q = &(worker->binding_queue);
-		if (q->tail != q->head) {
-			id = q->q[q->head % BINDING_SERVICE_QUEUE];
-			++q->head;
-			if (q->head == q->tail)
-				q->head = q->tail = 0;
+		if (!binding_queue_empty(q)) {
+			id = binding_queue_pop(q);
+			if (binding_queue_empty(q)) {
+				bitmap_clear(&worker->state->queued, worker->worker_id);
+			}
 		}
 		// only one producer (Worker) except itself (worker_steal_job), so don't need use CAS to set
 		worker->service_ready = id.id;
+		bitmap_set(&worker->state->ready, worker->worker_id);
 		return id;
 	} else {
 		// Already has a job
@@ -141,6 +298,13 @@ worker_assign_job(struct worker_thread *worker, service_id id) {
 	}
 }
 
+// Calling by Scheduler, set service_ready when the worker has no job
+static inline void
+worker_set_job(struct worker_thread *worker, service_id id) {
+	atomic_int_store(&worker->service_ready, id.id);
+	bitmap_set(&worker->state->ready, worker->worker_id);
+}
+
 // Calling by Worker, may consume service_ready
 static inline service_id
 worker_get_job(struct worker_thread *worker) {
@@ -174,6 +338,7 @@ worker_steal_job(struct worker_thread *worker, struct service_pool *p) {
 		if (atomic_int_cas(&worker->service_ready, job, 0)) {
 			id = t;
 			worker->waiting.id = 0;
+			bitmap_clear(&worker->state->ready, worker->worker_id);
 		}
 	}
 	return id;
@@ -182,6 +347,8 @@ worker_steal_job(struct worker_thread *worker, struct service_pool *p) {
 // Calling by Scheduler, may consume service_done
 static inline service_id
 worker_done_job(struct worker_thread *worker) {
+	// clear the hint before reading service_done, see worker_complete_job
+	bitmap_clear(&worker->state->done, worker->worker_id);
 	int done = worker->service_done;
 	if (done) {
 		// only one consumer (Scheduler) , so don't need use CAS to set
@@ -196,6 +363,7 @@ static inline int
 worker_complete_job(struct worker_thread *worker) {
 	if (atomic_int_cas(&worker->service_done, 0, worker->running.id)) {
 		worker->running.id = 0;
+		bitmap_set(&worker->state->done, worker->worker_id);
 		return 0;
 	}
 	return 1;
@@ -0,0 +1,46 @@
+-- Run by test_logfilter.lua, which sets log_rate, log_sample and log_summary
+
+local ltask = require "ltask"
+
+local N <const> = 10000
+local LOG_SAMPLE <const> = 100
+
+for i = 1, N do
+	ltask.log.infof("flood %d", i)
+end
+
+-- the dropped summary is pushed with the next log after log_summary (1s)
+ltask.sleep(110)
+ltask.log.info "flood end"
+
+local passed = 0
+local dropped = 0
+local summary = 0
+local last = 0
+while true do
+	local ti, _, msg, sz = ltask.poplog()
+	if ti == nil then
+		break
+	end
+	local _, message = ltask.log.format(msg, sz)
+	local i = message:match "^%( logfilter %) flood (%d+)$"
+	if i then
+		i = tonumber(i)
+		assert(i > last, "out of order")
+		last = i
+		passed = passed + 1
+	else
+		local n = message:match "^%( logfilter %) (%d+) logs dropped$"
+		if n then
+			dropped = dropped + tonumber(n)
+			summary = summary + 1
+		end
+	end
+end
+
+print(string.format("logfilter : %d passed, %d dropped, %d summaries", passed, dropped, summary))
+assert(summary > 0, "no dropped summary")
+assert(passed + dropped == N, "lost logs")
+-- a burst of log_rate, and one of every log_sample logs over the limit
+assert(passed < N // 2, "not limited")
+assert(passed >= N // LOG_SAMPLE // 2, "not sampled")
@@ -0,0 +1,226 @@
+// Test the timer of ltask : make timertest && ./timertest
+
+#include "timer.h"
+#include "sysapi.h"
+#include "thread.h"
+#include "atomic.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAX_ID 400000
+
+static unsigned char fired[MAX_ID];
+
+static int
+timer_fired(void *ud, void *arg) {
+	int id;
+	memcpy(&id, arg, sizeof(id));
+	++fired[id];
+	return 0;
+}
+
+static uint64_t
+add(struct timer *T, int ring, int id, int ti) {
+	uint64_t handle = timer_add(T, ring, &id, sizeof(id), ti);
+	assert(handle != 0);
+	return handle;
+}
+
+// run the timer for csec centiseconds
+static void
+run(struct timer *T, int csec) {
+	int i;
+	for (i=0;i<csec;i++) {
+		sys_sleep(10);
+		timer_update(T, timer_fired, NULL);
+	}
+	timer_update(T, timer_fired, NULL);
+}
+
+static void
+test_add(void) {
+	struct timer *T = timer_init(2);
+	add(T, 0, 1, 0);
+	add(T, 1, 2, 3);
+	add(T, -1, 3, 1);
+	run(T, 5);
+	assert(fired[1] == 1 && fired[2] == 1 && fired[3] == 1);
+	timer_destroy(T);
+	printf("add : ok\n");
+}
+
+static void
+test_cancel(void) {
+	struct timer *T = timer_init(2);
+	// cancel before merged
+	uint64_t h = add(T, 0, 10, 5);
+	assert(timer_cancel(T, 0, h) == 0);
+	// cancel after merged
+	uint64_t h2 = add(T, 0, 11, 5);
+	timer_update(T, timer_fired, NULL);
+	run(T, 1);
+	assert(timer_cancel(T, 0, h2) == 0);
+	// the cancel from the shared queue
+	uint64_t h3 = add(T, 1, 12, 5);
+	assert(timer_cancel(T, -1, h3) == 0);
+	run(T, 8);
+	assert(fired[10] == 0 && fired[11] == 0 && fired[12] == 0);
+	// cancel twice
+	timer_cancel(T, 0, h);
+	run(T, 1);
+	timer_destroy(T);
+	printf("cancel : ok\n");
+}
+
+static void
+test_late_cancel(void) {
+	struct timer *T = timer_init(1);
+	uint64_t h = add(T, 0, 20, 1);
+	run(T, 3);
+	assert(fired[20] == 1);
+	// expired already
+	assert(timer_cancel(T, 0, h) == 1);
+	assert(timer_cancel(T, -1, h) == 1);
+	run(T, 1);
+	assert(fired[20] == 1);
+	timer_destroy(T);
+	printf("late cancel : ok\n");
+}
+
+static void
+test_deferred_cancel(void) {
+	struct timer *T = timer_init(2);
+	// The service moves from worker 1 to worker 0 between timer_add and timer_cancel.
+	// Ring 0 is merged before ring 1, so the cancel is seen before the timer.
+	uint64_t h = add(T, 1, 30, 3);
+	assert(timer_cancel(T, 0, h) == 0);
+	// a cancel of an unknown handle is dropped after a merge
+	timer_cancel(T, 0, h + (1ull << 40));
+	run(T, 6);
+	assert(fired[30] == 0);
+	timer_destroy(T);
+	printf("deferred cancel : ok\n");
+}
+
+static int
+timer_refuse(void *ud, void *arg) {
+	int *refuse = (int *)ud;
+	if (*refuse > 0) {
+		--*refuse;
+		return 1;
+	}
+	return timer_fired(NULL, arg);
+}
+
+static void
+test_retry(void) {
+	struct timer *T = timer_init(1);
+	int refuse = 2;
+	add(T, 0, 40, 0);
+	add(T, 0, 41, 0);
+	timer_update(T, timer_refuse, &refuse);
+	assert(fired[40] == 0 && fired[41] == 0);
+	int i;
+	for (i=0;i<5;i++) {
+		sys_sleep(10);
+		timer_update(T, timer_refuse, &refuse);
+	}
+	assert(refuse == 0 && fired[40] == 1 && fired[41] == 1);
+	timer_destroy(T);
+	printf("retry : ok\n");
+}
+
+#define PRODUCER 4
+#define PRODUCER_N 50000
+
+struct producer {
+	struct timer *T;
+	int ring;
+	int base;
+	atomic_int *done;
+	unsigned char *cancelled;
+};
+
+static void
+producer(void *ud) {
+	struct producer *p = (struct producer *)ud;
+	uint64_t h[8] = { 0 };
+	int i;
+	for (i=0;i<PRODUCER_N;i++) {
+		int id = p->base + i;
+		h[i % 8] = add(p->T, p->ring, id, i % 7);
+		if (i % 2) {
+			int prev = i - (i % 3);
+			uint64_t handle = h[prev % 8];
+			if (handle) {
+				// cancel from the shared queue sometimes, as the service has moved
+				int ring = (i % 5 == 0) ? -1 : p->ring;
+				if (timer_cancel(p->T, ring, handle) == 0)
+					p->cancelled[p->base + prev] = 1;
+				h[prev % 8] = 0;
+			}
+		}
+		if (i % 500 == 0)
+			sys_sleep(1);
+	}
+	atomic_int_inc(p->done);
+}
+
+static void
+ticker(void *ud) {
+	struct producer *p = (struct producer *)ud;
+	while (atomic_int_load(p->done) < PRODUCER) {
+		timer_update(p->T, timer_fired, NULL);
+		sys_sleep(1);
+	}
+	run(p->T, 10);
+}
+
+// the result of timer_cancel is exact : cancelled timers never fire, the others fire once
+static void
+test_stress(void) {
+	static unsigned char cancelled[MAX_ID];
+	struct timer *T = timer_init(PRODUCER - 1);
+	atomic_int done;
+	atomic_int_init(&done, 0);
+	struct producer p[PRODUCER + 1];
+	struct thread t[PRODUCER + 1];
+	int i;
+	memset(fired, 0, sizeof(fired));
+	for (i=0;i<=PRODUCER;i++) {
+		p[i].T = T;
+		p[i].ring = (i == PRODUCER - 1) ? -1 : i;	// the last producer has no ring
+		p[i].base = i * PRODUCER_N;
+		p[i].done = &done;
+		p[i].cancelled = cancelled;
+		t[i].func = (i == PRODUCER) ? ticker : producer;
+		t[i].ud = &p[i];
+	}
+	void *handle = thread_start(t, PRODUCER + 1, 0);
+	assert(handle != NULL);
+	thread_join(handle, PRODUCER + 1);
+	int n = 0;
+	for (i=0;i<PRODUCER * PRODUCER_N;i++) {
+		if (cancelled[i]) {
+			assert(fired[i] == 0);
+			++n;
+		} else {
+			assert(fired[i] == 1);
+		}
+	}
+	timer_destroy(T);
+	printf("stress : ok (%d cancelled)\n", n);
+}
+
+int
+main() {
+	test_add();
+	test_cancel();
+	test_late_cancel();
+	test_deferred_cancel();
+	test_retry();
+	test_stress();
+	return 0;
+}
@@ -0,0 +1,105 @@
+// Measure the latency of waking up a sleeping worker : make wakeuptest && ./wakeuptest
+// Build with -DDISABLE_FUTEX to compare with the condition variable
+
+#include "worker.h"
+#include "sysapi.h"
+
+#include <stdio.h>
+
+#define PINGPONG 100000
+#define PARKED 2000
+
+struct pair {
+	struct worker_thread w[2];
+	atomic_u64 stamp;	// the ping is sent at
+	uint64_t *latency;
+	int n;
+	int parked;	// let the pong side park before each ping
+};
+
+static void
+wait_job(struct worker_thread *w) {
+	while (!worker_has_job(w)) {
+		worker_sleep(w);
+	}
+	atomic_int_store(&w->service_ready, 0);
+}
+
+static void
+post_job(struct worker_thread *w) {
+	atomic_int_store(&w->service_ready, 1);
+	worker_wakeup(w);
+}
+
+static void
+ping(void *ud) {
+	struct pair *p = (struct pair *)ud;
+	int i;
+	for (i=0;i<p->n;i++) {
+		if (p->parked)
+			sys_sleep(1);
+		atomic_u64_store(&p->stamp, systime_counter());
+		post_job(&p->w[1]);
+		wait_job(&p->w[0]);
+	}
+}
+
+static void
+pong(void *ud) {
+	struct pair *p = (struct pair *)ud;
+	int i;
+	for (i=0;i<p->n;i++) {
+		wait_job(&p->w[1]);
+		p->latency[i] = systime_counter() - atomic_u64_load(&p->stamp);
+		post_job(&p->w[0]);
+	}
+}
+
+static int
+compar(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+run(const char *name, int n, int parked) {
+	struct pair p;
+	worker_init(&p.w[0], NULL, NULL, 0);
+	worker_init(&p.w[1], NULL, NULL, 1);
+	atomic_u64_init(&p.stamp, 0);
+	p.latency = (uint64_t *)malloc(n * sizeof(uint64_t));
+	assert(p.latency);
+	p.n = n;
+	p.parked = parked;
+	struct thread t[2] = {
+		{ ping, &p },
+		{ pong, &p },
+	};
+	void *handle = thread_start(t, 2, 0);
+	thread_join(handle, 2);
+	qsort(p.latency, n, sizeof(uint64_t), compar);
+	double ns = 1000000000.0 / (double)systime_frequency();
+	uint64_t sum = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		sum += p.latency[i];
+	}
+	printf("%-8s n = %6d  avg = %8.0f ns  p50 = %8.0f ns  p99 = %8.0f ns\n", name, n,
+		(double)sum / n * ns, p.latency[n / 2] * ns, p.latency[n - n / 100 - 1] * ns);
+	free(p.latency);
+	worker_destroy(&p.w[0]);
+	worker_destroy(&p.w[1]);
+}
+
+int
+main() {
+#ifdef FUTEX_SUPPORT
+	printf("futex eventcount\n");
+#else
+	printf("condition variable\n");
+#endif
+	run("pingpong", PINGPONG, 0);
+	run("parked", PARKED, 1);
+	return 0;
+}
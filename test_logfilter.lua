@@ -0,0 +1,19 @@
+local start = require "test.start"
+start {
+    core = {
+        worker = 3,
+        log_rate = 10,
+        log_sample = 100,
+        log_summary = 1,
+    },
+    service_path = "service/?.lua;test/?.lua",
+    bootstrap = {
+        {
+            name = "timer",
+            unique = true,
+        },
+        {
+            name = "logfilter",
+        },
+    },
+}